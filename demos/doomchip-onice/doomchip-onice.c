@@ -238,6 +238,56 @@ static inline int sectorLightLevel(int sec,int frame,int rand)
 #define FPh         16
 #define DEPTH_SHIFT 11
 
+// -----------------------------------------------------
+// Reciprocals
+// -----------------------------------------------------
+
+#define INV_D_TABLE_SIZE 1024
+
+// Table of (1<<25)/x, distance from inverse distance (and back) without div
+int inv_d     [INV_D_TABLE_SIZE+1];
+// Table of (1<<FPm)/sin, per column perspective correction
+int col_inv_sw[doomchip_width];
+
+// Pre-computes the tables (once, before any frame)
+static inline void recip_pre()
+{
+  inv_d[0] = 0;
+  for (int i = 1; i <= INV_D_TABLE_SIZE; ++i) {
+    inv_d[i] = div(1<<25,i);
+  }
+  for (int c = 0; c < doomchip_width; ++c) {
+    int sin_view  = sin_m[(col_to_alpha[c] + 1024) & 4095];
+    col_inv_sw[c] = div(1<<FPm,sin_view);
+  }
+}
+
+// Returns (1<<25)/x without a division, same result as the divide.
+//
+// Beyond the table, x is shifted down to m in [INV_D_TABLE_SIZE/2,
+// INV_D_TABLE_SIZE) and the result is interpolated between inv_d[m] and
+// inv_d[m+1] with the bits shifted out. The estimate is off by at most one
+// for all x below 1<<22 (invd is at most 1<<18 as ry >= 16), and a single
+// residual test fixes it.
+static inline int recip(int x)
+{
+  if (x <= 0) {
+    return div(1<<25,x); // not expected, keep the divide semantics
+  } else if (x <= INV_D_TABLE_SIZE) {
+    return inv_d[x];
+  }
+  int m = x, s = 0;
+  while (m >= INV_D_TABLE_SIZE) { m >>= 1; ++s; }
+  int fr = x & ((1<<s)-1);
+  int r  = (inv_d[m] - (mul(inv_d[m] - inv_d[m+1],fr) >> s)) >> s;
+  if (mul(r,x) > (1<<25)) {
+    -- r;
+  } else if (mul(r+1,x) <= (1<<25)) {
+    ++ r;
+  }
+  return r;
+}
+
 // -----------------------------------------------------
 // Global game state
 // -----------------------------------------------------
@@ -255,10 +305,6 @@ int view_z;
 int view_a;
 volatile int view_sector; // volatile when accessed by both cores
 volatile int sector_f_T;
-// frustum
-int sinview;  int cosview;
-int sinleft;  int cosleft;
-int sinright; int cosright;
 
 // helper function to compute screen height for columns
 static inline int to_h(int h,int invD) {
@@ -274,16 +320,14 @@ static inline int to_h(int h,int invD) {
 #define N_VIS       512
 #define MAX_SPRITES  64
 
-int                    vis_ssec_next;
-unsigned short         vis_ssecs      [N_VIS_SEC];
-unsigned short         vis_p0         [N_VIS_SEC]; // NOTE could be made uchar using sub-frustrums
-unsigned short         vis_p1         [N_VIS_SEC];
-unsigned short         vis_begin      [N_VIS_SEC];
-unsigned char          vis_len        [N_VIS_SEC];
-unsigned char          vis_seclight   [N_VIS_SEC];
+#define COL_BUCKET_SHIFT   3 // columns per bucket: 8
+#define N_COL_BUCKETS      ((doomchip_width + (1<<COL_BUCKET_SHIFT) - 1) >> COL_BUCKET_SHIFT)
+#define N_COL_BUCKET_SEGS  2048
+#define N_SPRITE_BUCKET_VIS 512
 
 struct vis_record {
   unsigned short owner;
+  unsigned char  ssc;   // index of the vis sub-sector (level segments)
   int            invd;
   int            invd_inc;
   int            tu_invd;
@@ -292,21 +336,71 @@ struct vis_record {
   unsigned short i1;
 };
 
-int                    vis_seg_next;
-struct vis_record      vis            [N_VIS];
+struct sprite {
+  unsigned char  thing;
+  int            dist;
+  unsigned short sec;
+  unsigned char  light;
+	unsigned char  w;
+  unsigned char  h;
+  unsigned char  frame;
+  unsigned char  flags;
+};
 
-int                    num_level_vis_segs;
+// A frame is drawn from its viewpoint and the visibility computed for it.
+// There are two: core 1 fills one for the next frame while the columns of
+// the current frame are drawn from the other, they are swapped in between.
+struct frame_vis {
+  // viewpoint
+  int            view_x;
+  int            view_y;
+  int            view_z;
+  int            view_a;
+  // frustum
+  int sinview;  int cosview;
+  int sinleft;  int cosleft;
+  int sinright; int cosright;
+  // lighting
+  int            frame;
+  unsigned int   rand;
+  // visible sub-sectors
+  int            vis_ssec_next;
+  unsigned short vis_ssecs      [N_VIS_SEC];
+  unsigned char  vis_seclight   [N_VIS_SEC];
+  // visible segments, followed by the sprites
+  int               vis_seg_next;
+  struct vis_record vis         [N_VIS];
+  int               num_level_vis_segs;
+  // level segments bucketed by groups of columns, front to back
+  unsigned short    col_bucket_begin[N_COL_BUCKETS];
+  unsigned short    col_bucket_end  [N_COL_BUCKETS];
+  unsigned short    col_bucket_segs [N_COL_BUCKET_SEGS];
+  // sprites
+  int            num_sprites;
+  struct sprite  sprites        [MAX_SPRITES];
+  // sprites bucketed by groups of columns, near to far (vis indices)
+  unsigned short sprite_order        [MAX_SPRITES];
+  unsigned short sprite_bucket_begin [N_COL_BUCKETS];
+  unsigned short sprite_bucket_end   [N_COL_BUCKETS];
+  unsigned short sprite_bucket_vis   [N_SPRITE_BUCKET_VIS];
+  // sectors seen when drawing the frame, used to add sprites two frames later
+  // unsigned int sector_vis[N_BSP_SECTORS/32+1];
+  unsigned int   sector_vis     [N_BSP_SECTORS];
+};
 
-// unsigned int sector_vis[N_BSP_SECTORS/32+1];
-unsigned int sector_vis[N_BSP_SECTORS];
+struct frame_vis  frame_vis_bufs[2];
+struct frame_vis *fv_draw = &frame_vis_bufs[0]; // columns are drawn from this one
+struct frame_vis *fv_next = &frame_vis_bufs[1]; // visibility of the next frame
 
-int stack [64]; // stack for BSP traversal
+int stack [64]; // stack for BSP traversal (core 1)
+const struct bsp_bbox *stack_bbox[64]; // bbox of each stacked child
+int collision_stack [64]; // stack for collisions (core 0, concurrent)
 
 // -----------------------------------------------------
 // Visible sectors
 // -----------------------------------------------------
 
-static inline void sec_vis_reset()
+static inline void sec_vis_reset(struct frame_vis *f)
 {
   //for (int i = 0; i < (N_BSP_SECTORS/32+1); ++i) {
   //  sector_vis[i] = 0;
@@ -315,21 +409,103 @@ static inline void sec_vis_reset()
     //if (sector_vis[i]) {
     //  printf("%d,",i);
     //}
-    sector_vis[i] = 0;
+    f->sector_vis[i] = 0;
   }
   //printf("\n");
 }
 
-static inline void sec_vis_add(int sec)
+static inline void sec_vis_add(struct frame_vis *f,int sec)
 {
   // sector_vis[sec>>5] = sector_vis[sec>>5] | (1 << (sec&31));
-  sector_vis[sec] = 1;
+  f->sector_vis[sec] = 1;
 }
 
-static inline int sec_vis_test(int sec)
+static inline int sec_vis_test(struct frame_vis *f,int sec)
 {
   // return sector_vis[sec>>5] & (1 << (sec&31));
-  return sector_vis[sec];
+  return f->sector_vis[sec];
+}
+
+// -----------------------------------------------------
+// Closed columns
+// -----------------------------------------------------
+
+#define N_COLS_CLOSED_WORDS ((doomchip_width+31)/32)
+
+// Columns closed by an opaque wall during the BSP traversal, which is
+// front to back, anything projecting onto closed columns only is hidden
+unsigned int cols_closed[N_COLS_CLOSED_WORDS];
+
+static inline void cols_reset()
+{
+  for (int w = 0; w < N_COLS_CLOSED_WORDS; ++w) {
+    cols_closed[w] = 0;
+  }
+}
+
+// mask of the bits of word w within [c0,c1]
+static inline unsigned int cols_mask(int w,int c0,int c1)
+{
+  unsigned int m = 0xffffffff;
+  if (w == (c0>>5)) { m &= 0xffffffff << (c0&31);      }
+  if (w == (c1>>5)) { m &= 0xffffffff >> (31-(c1&31)); }
+  return m;
+}
+
+static inline void cols_close(int c0,int c1)
+{
+  for (int w = c0>>5; w <= (c1>>5); ++w) {
+    cols_closed[w] |= cols_mask(w,c0,c1);
+  }
+}
+
+static inline int cols_all_closed(int c0,int c1)
+{
+  for (int w = c0>>5; w <= (c1>>5); ++w) {
+    unsigned int m = cols_mask(w,c0,c1);
+    if ((cols_closed[w] & m) != m) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// an opaque middle wall closes the columns it covers, see draw_column
+static inline int seg_closes(int seg)
+{
+  return bspSegs[seg].mid != 0
+      && bspSegs[seg].mid != TERRAIN_ID
+      && (bspSegs[seg].flags&1) == 0;
+}
+
+// Returns 1 if a bbox projects onto closed columns only. Its screen extent
+// is the projection of its two extreme corners (a box fully in front of the
+// near plane), widened by a column on each side for rounding.
+static inline int bbox_occluded(struct frame_vis *f,const struct bsp_bbox *bbox)
+{
+  const int near = 16;
+  const int lim  = 1<<14; // keeps the cross products in range
+  int lx = 0, ly = 1;     // leftmost  corner (smallest rx/ry)
+  int hx = 0, hy = 1;     // rightmost corner (largest  rx/ry)
+  for (int i = 0; i < 4; ++i) {
+    int dx = ((i == 0 || i == 3) ? bbox->x_lw : bbox->x_hi) - f->view_x;
+    int dy = ((i <  2)           ? bbox->y_lw : bbox->y_hi) - f->view_y;
+    int rx = - dot(dy, f->cosview, - dx, f->sinview) >> FPm;
+    int ry =   dot(dx, f->cosview,   dy, f->sinview) >> FPm;
+    if (ry < near || ry > lim || rx < -lim || rx > lim) {
+      return 0; // crosses the near plane (or too far), keep
+    }
+    if (i == 0 || mul(rx,ly) < mul(lx,ry)) { lx = rx; ly = ry; }
+    if (i == 0 || mul(rx,hy) > mul(hx,ry)) { hx = rx; hy = ry; }
+  }
+  int c0 = div(mul(lx,3*doomchip_width/4),ly) + doomchip_width/2 - 1;
+  int c1 = div(mul(hx,3*doomchip_width/4),hy) + doomchip_width/2 + 1;
+  if (c0 < 0)               { c0 = 0; }
+  if (c1 >= doomchip_width) { c1 = doomchip_width-1; }
+  if (c0 > c1) {
+    return 0; // off screen, left to the frustum test
+  }
+  return cols_all_closed(c0,c1);
 }
 
 // -----------------------------------------------------
@@ -337,25 +513,25 @@ static inline int sec_vis_test(int sec)
 // -----------------------------------------------------
 
 // Add a segment to the list of visible segments to be drawn
-static inline int add_segment(
+static inline int add_segment(struct frame_vis *f,
   const struct p2d v0,const struct p2d v1,int slen,int max_vis_segs)
 {
   // prepare segment for display
-  if (seg_frustum(view_x,view_y,
-                  cosleft,sinleft, cosview,sinview, cosright,sinright,
+  if (seg_frustum(f->view_x,f->view_y,
+                  f->cosleft,f->sinleft, f->cosview,f->sinview, f->cosright,f->sinright,
                   v0.x,v0.y, v1.x,v1.y)) {
     // add to vis
-    if (vis_seg_next < max_vis_segs) {
+    if (f->vis_seg_next < max_vis_segs) {
       // project
-      int d0x = v0.x - view_x;
-      int d0y = v0.y - view_y;
-      int d1x = v1.x - view_x;
-      int d1y = v1.y - view_y;
+      int d0x = v0.x - f->view_x;
+      int d0y = v0.y - f->view_y;
+      int d1x = v1.x - f->view_x;
+      int d1y = v1.y - f->view_y;
       // -> rotate in view
-      int rx0       = - dot(d0y, cosview, - d0x, sinview) >> FPm;
-      int rx1       = - dot(d1y, cosview, - d1x, sinview) >> FPm;
-      int ry0       =   dot(d0x, cosview,   d0y, sinview) >> FPm;
-      int ry1       =   dot(d1x, cosview,   d1y, sinview) >> FPm;
+      int rx0       = - dot(d0y, f->cosview, - d0x, f->sinview) >> FPm;
+      int rx1       = - dot(d1y, f->cosview, - d1x, f->sinview) >> FPm;
+      int ry0       =   dot(d0x, f->cosview,   d0y, f->sinview) >> FPm;
+      int ry1       =   dot(d1x, f->cosview,   d1y, f->sinview) >> FPm;
       const int near = 16;
       int in_front0 = ry0 >= near;
       int in_front1 = ry1 >= near;
@@ -396,8 +572,8 @@ static inline int add_segment(
         }
         // -> compute interpolation ratio
         // -> setup invd interpolation
-        int invd0       = div( (1<<22) , ry0 );
-        int invd1       = div( (1<<22) , ry1 );
+        int invd0       = recip(ry0) >> 3; // == (1<<22)/ry0
+        int invd1       = recip(ry1) >> 3;
         int invd        = invd0;
         int invd_inc    = div( (invd1 - invd0), (p1-p0) );
         int tu_invd0    = mul( tu0, invd0 ) >> 6;
@@ -422,7 +598,7 @@ static inline int add_segment(
           }
         }
         // insert the ssec vis record
-        vis[vis_seg_next] = (struct vis_record){
+        f->vis[f->vis_seg_next] = (struct vis_record){
           .owner       = -1,
           .invd        = invd,
           .invd_inc    = invd_inc,
@@ -433,13 +609,13 @@ static inline int add_segment(
         };
 
         // add to vis list
-        return vis_seg_next ++;
+        return f->vis_seg_next ++;
 
       }
 
     } else {
 #ifdef SIMULATION
-			printf("too many vis segments (%d / %d)\n",vis_seg_next, max_vis_segs);
+			printf("too many f->vis segments (%d / %d)\n",f->vis_seg_next, max_vis_segs);
 #endif
       // too many vis segments
       return -1;
@@ -450,44 +626,114 @@ static inline int add_segment(
 
 // -----------------------------------------------------
 
+// Buckets vis records by groups of columns, so that a column only visits
+// the records overlapping its group. This is a counting sort, the order of
+// the records (order[i], or i if order is null) is preserved in each bucket.
+static inline void bucket_vis(struct frame_vis *f,
+  const unsigned short *order,int n,
+  unsigned short *begin,unsigned short *end,unsigned short *out,int max_out)
+{
+  // count
+  for (int b = 0; b < N_COL_BUCKETS; ++b) {
+    end[b] = 0;
+  }
+  int total = 0;
+  for (int i = 0; i < n; ++i) {
+    int v  = order ? order[i] : i;
+    int i1 = f->vis[v].i1 < doomchip_width ? f->vis[v].i1 : doomchip_width-1;
+    int b0 = f->vis[v].i0 >> COL_BUCKET_SHIFT;
+    int b1 = i1           >> COL_BUCKET_SHIFT;
+    for (int b = b0; b <= b1; ++b) {
+      ++ end[b];
+    }
+    total += b1 - b0 + 1;
+  }
+  if (total > max_out) {
+#ifdef SIMULATION
+    printf("too many bucketed records (%d / %d)\n",total,max_out);
+#endif
+    // fall back to all records in every bucket
+    for (int i = 0; i < n; ++i) {
+      out[i] = order ? order[i] : i;
+    }
+    for (int b = 0; b < N_COL_BUCKETS; ++b) {
+      begin[b] = 0;
+      end  [b] = n;
+    }
+    return;
+  }
+  // start of each bucket
+  int start = 0;
+  for (int b = 0; b < N_COL_BUCKETS; ++b) {
+    begin[b] = start;
+    start   += end[b];
+    end  [b] = begin[b];
+  }
+  // fill, in order
+  for (int i = 0; i < n; ++i) {
+    int v  = order ? order[i] : i;
+    int i1 = f->vis[v].i1 < doomchip_width ? f->vis[v].i1 : doomchip_width-1;
+    int b0 = f->vis[v].i0 >> COL_BUCKET_SHIFT;
+    int b1 = i1           >> COL_BUCKET_SHIFT;
+    for (int b = b0; b <= b1; ++b) {
+      out[end[b] ++] = v;
+    }
+  }
+}
+
+// -----------------------------------------------------
+
 // Traverses the BSP and collects the potentially visible sub-sectors
 // Transforms and projects all potentially visible segments
-static inline void bsp_pvs()
+static inline void bsp_pvs(struct frame_vis *f)
 {
   // traverse BSP (sort sectors)
   int stack_ptr    = 0;
-  stack [stack_ptr] = root;
+  stack     [stack_ptr] = root;
+  stack_bbox[stack_ptr] = 0;
   stack_ptr         = stack_ptr + 1;
-  vis_ssec_next     = 0;
+  f->vis_ssec_next  = 0;
+  // no column closed yet
+  cols_reset();
+  int screen_closed = 0;
 
-  while (stack_ptr != 0) {
+  while (stack_ptr != 0 && !screen_closed) {
     // pop
     stack_ptr = stack_ptr - 1;
     int n    = stack[stack_ptr];
 
+    // hidden behind closed columns?
+    if (stack_bbox[stack_ptr] && bbox_occluded(f,stack_bbox[stack_ptr])) {
+      continue;
+    }
+
     if ((n & 32768) == 0) {
 
       // tree node
-      int dx  = view_x - bspNodes[n].x;
-      int dy  = view_y - bspNodes[n].y;
+      int dx  = f->view_x - bspNodes[n].x;
+      int dy  = f->view_y - bspNodes[n].y;
       int csl = mul(dx , bspNodes[n].dy);
       int csr = mul(dy , bspNodes[n].dx);
       if (csr > csl) {
-        stack[stack_ptr] = bspNodes[n].rchild;
+        stack     [stack_ptr] = bspNodes[n].rchild;
+        stack_bbox[stack_ptr] = &bspNodes[n].rbb;
         stack_ptr        = stack_ptr + 1;
-        if (bbox_frustum(view_x,view_y,
-                        cosleft,sinleft, cosview,sinview, cosright,sinright,
+        if (bbox_frustum(f->view_x,f->view_y,
+                        f->cosleft,f->sinleft, f->cosview,f->sinview, f->cosright,f->sinright,
                         &bspNodes[n].lbb)) {
-          stack[stack_ptr] = bspNodes[n].lchild;
+          stack     [stack_ptr] = bspNodes[n].lchild;
+          stack_bbox[stack_ptr] = &bspNodes[n].lbb;
           stack_ptr        = stack_ptr + 1;
         }
       } else {
-        stack[stack_ptr]  = bspNodes[n].lchild;
+        stack     [stack_ptr] = bspNodes[n].lchild;
+        stack_bbox[stack_ptr] = &bspNodes[n].lbb;
         stack_ptr         = stack_ptr + 1;
-        if (bbox_frustum(view_x,view_y,
-                        cosleft,sinleft, cosview,sinview, cosright,sinright,
+        if (bbox_frustum(f->view_x,f->view_y,
+                        f->cosleft,f->sinleft, f->cosview,f->sinview, f->cosright,f->sinright,
                         &bspNodes[n].rbb)) {
-          stack[stack_ptr] = bspNodes[n].rchild;
+          stack     [stack_ptr] = bspNodes[n].rchild;
+          stack_bbox[stack_ptr] = &bspNodes[n].rbb;
           stack_ptr        = stack_ptr + 1;
         }
       }
@@ -496,9 +742,7 @@ static inline void bsp_pvs()
 
       // subsector reached
       int ssec     = n & 32767;
-      int n_before = vis_seg_next;
-      int ssec_i0  = doomchip_width;
-      int ssec_i1  = 0;
+      int n_before = f->vis_seg_next;
 
 			// for each segment
       for (int s = 0; s < bspSSectors[ssec].num_segs ; s++) {
@@ -507,37 +751,47 @@ static inline void bsp_pvs()
         struct p2d v1 = bspSegs[seg].v1;
         int    slen   = bspSegs[seg].seglen;
         // try to add segment
-        int vid = add_segment(v0,v1,slen, N_VIS-MAX_SPRITES);
+        int vid = add_segment(f,v0,v1,slen, N_VIS-MAX_SPRITES);
         if (vid != -1) {
+          int i0 = f->vis[vid].i0;
+          int i1 = f->vis[vid].i1 < doomchip_width ? f->vis[vid].i1 : doomchip_width-1;
+          // hidden behind closed columns?
+          if (cols_all_closed(i0,i1)) {
+            -- f->vis_seg_next; // remove
+            continue;
+          }
           // set owner
-          vis[vid].owner = seg;
-          // track min-max projected columns for the ssec (sub-sector)
-          int i0 = vis[vid].i0;
-          int i1 = vis[vid].i1;
-          if (i0 < ssec_i0) ssec_i0 = i0;
-          if (i1 > ssec_i1) ssec_i1 = i1;
+          f->vis[vid].owner = seg;
+          f->vis[vid].ssc   = f->vis_ssec_next;
+          // close columns behind an opaque wall
+          if (seg_closes(seg)) {
+            cols_close(i0,i1);
+            screen_closed = cols_all_closed(0,doomchip_width-1);
+          }
         }
       }
 
-      int n_added = vis_seg_next - n_before;
+      int n_added = f->vis_seg_next - n_before;
 
       if (n_added) {
-        if (vis_ssec_next < N_VIS_SEC) {
-          vis_ssecs   [vis_ssec_next] = ssec;
-          vis_p0      [vis_ssec_next] = ssec_i0;
-          vis_p1      [vis_ssec_next] = ssec_i1;
-          vis_len     [vis_ssec_next] = n_added;
-          int sec                     = bspSSectors[ssec].parentsec;
-          vis_seclight[vis_ssec_next] = sectorLightLevel(sec,frame,rand);
-          ++ vis_ssec_next;
+        if (f->vis_ssec_next < N_VIS_SEC) {
+          f->vis_ssecs   [f->vis_ssec_next] = ssec;
+          int sec                           = bspSSectors[ssec].parentsec;
+          f->vis_seclight[f->vis_ssec_next] = sectorLightLevel(sec,f->frame,f->rand);
+          ++ f->vis_ssec_next;
         } else {
-          // too many sub-sectors
+          // too many sub-sectors, drop its segments
+          f->vis_seg_next = n_before;
           break;
         }
       }
     }
   }
-  num_level_vis_segs = vis_seg_next;
+  f->num_level_vis_segs = f->vis_seg_next;
+  // level segments by columns, front to back
+  bucket_vis(f, 0,f->num_level_vis_segs,
+             f->col_bucket_begin,f->col_bucket_end,f->col_bucket_segs,
+             N_COL_BUCKET_SEGS);
 }
 
 // -----------------------------------------------------
@@ -570,22 +824,75 @@ static inline int find_sector(int px,int py)
 }
 
 // -----------------------------------------------------
-// Sprites
+// Column commands: core 0 draws columns straight to the GPU, once core 1
+// joins it builds the commands of the odd columns in a ring buffer that
+// core 0 forwards, so the GPU still receives the columns in order
 // -----------------------------------------------------
 
-struct sprite {
-  unsigned char  thing;
-  int            dist;
-  unsigned short sec;
-  unsigned char  light;
-	unsigned char  w;
-  unsigned char  h;
-  unsigned char  frame;
-  unsigned char  flags;
+struct col_cmd {
+  unsigned int tex0;
+  unsigned int tex1;
 };
 
-int           num_sprites;
-struct sprite sprites[MAX_SPRITES];
+#define COL_RING_SIZE 256 // power of two
+struct col_cmd col_ring[COL_RING_SIZE];
+volatile int   col_ring_head; // next slot written by core 1 (producer)
+volatile int   col_ring_tail; // next slot read by core 0 (consumer)
+
+volatile int   core1_todo;
+volatile int   core1_join;  // core 1 is done with visibility, asks for columns
+volatile int   core1_first; // first odd column core 1 builds, set by core 0
+volatile int   core1_done;
+
+// ensures the compiler keeps ring writes/reads on the right side of the
+// head/tail updates (the hardware itself does not reorder)
+#define memory_barrier() asm volatile ("" : : : "memory")
+
+// sends a command pair, to the GPU on core 0, to the ring on core 1
+static inline void col_out(int core,unsigned int tex0,unsigned int tex1)
+{
+  if (core == 0) {
+    col_send(tex0,tex1);
+  } else {
+    // wait for a free slot
+    while (((col_ring_head + 1) & (COL_RING_SIZE-1)) == col_ring_tail) { }
+    col_ring[col_ring_head].tex0 = tex0;
+    col_ring[col_ring_head].tex1 = tex1;
+    memory_barrier();
+    col_ring_head = (col_ring_head + 1) & (COL_RING_SIZE-1);
+  }
+}
+
+// waits for room in the GPU FIFO (core 0 only, col_out waits on the ring)
+static inline void col_wait(int core)
+{
+  if (core == 0) {
+    col_process();
+  }
+}
+
+// forwards the commands of the next column built by core 1 (runs on core 0)
+static inline void col_forward()
+{
+  while (1) {
+    // wait for core 1
+    while (col_ring_tail == col_ring_head) { }
+    memory_barrier();
+    struct col_cmd cmd = col_ring[col_ring_tail];
+    // release the slot
+    memory_barrier();
+    col_ring_tail = (col_ring_tail + 1) & (COL_RING_SIZE-1);
+    col_process();
+    col_send(cmd.tex0,cmd.tex1);
+    if (cmd.tex1 == COLDRAW_EOC) {
+      break; // no other command has this second word
+    }
+  }
+}
+
+// -----------------------------------------------------
+// Sprites
+// -----------------------------------------------------
 
 // Selects a sprite frame based on angle
 void spriteSelect(int angle,int ani_frame,int *sprt_frame,int *sptr_mirror)
@@ -622,96 +929,117 @@ void spriteSelect(int angle,int ani_frame,int *sprt_frame,int *sptr_mirror)
 }
 
 // goes through things and add those potentially visible as sprites
-static inline void add_sprites()
+static inline void add_sprites(struct frame_vis *f)
 {
-  num_sprites = 0;
+  f->num_sprites = 0;
   for (int t = 0; t < n_things ; ++t) {
     int sprt_x    = things[t].x;
     int sprt_y    = things[t].y;
     int sec       = find_sector(sprt_x,sprt_y);
-    if (!sec_vis_test(sec)) {
+    if (!sec_vis_test(f,sec)) {
       continue;
     }
     int dimid     = things[t].first_frame - first_sprite_index;
     int sprt_w    = sprtdims[(dimid<<1)+0];
     int sprt_h    = sprtdims[(dimid<<1)+1];
     int sprt_r    = sprt_w;
-    int sprt_vx   = mul(sprt_r,-sinview) >> (FPm+1);
-    int sprt_vy   = mul(sprt_r, cosview) >> (FPm+1);
+    int sprt_vx   = mul(sprt_r,-f->sinview) >> (FPm+1);
+    int sprt_vy   = mul(sprt_r, f->cosview) >> (FPm+1);
     struct p2d p0 = {.x = sprt_x-sprt_vx, .y = sprt_y-sprt_vy};
     struct p2d p1 = {.x = sprt_x+sprt_vx, .y = sprt_y+sprt_vy};
     // try to add segment
-    int vid = add_segment(p0,p1,sprt_r,N_VIS);
+    int vid = add_segment(f,p0,p1,sprt_r,N_VIS);
     if (vid != -1) {
       // precompute distance
-      int y = div( 1<<25, vis[vid].invd );
+      int y = recip(f->vis[vid].invd);
       // verify not too close
       if (y < 64) {
-        -- vis_seg_next; // remove
+        -- f->vis_seg_next; // remove
         continue;
       }
       // set parent
-      sprites[num_sprites].thing = t;
+      f->sprites[f->num_sprites].thing = t;
       // set distance
-      sprites[num_sprites].dist  = y;
+      f->sprites[f->num_sprites].dist  = y;
       // set width,height
-			sprites[num_sprites].w     = sprt_w;
-      sprites[num_sprites].h     = sprt_h;
+			f->sprites[f->num_sprites].w     = sprt_w;
+      f->sprites[f->num_sprites].h     = sprt_h;
       // set sector
-      sprites[num_sprites].sec   = sec;
-      sprites[num_sprites].light = sectorLightLevel(sprites[num_sprites].sec,frame,rand);
+      f->sprites[f->num_sprites].sec   = sec;
+      f->sprites[f->num_sprites].light = sectorLightLevel(f->sprites[f->num_sprites].sec,f->frame,f->rand);
       // reset flags
-      sprites[num_sprites].flags = 0;
+      f->sprites[f->num_sprites].flags = 0;
       // set frame
       if (things[t].flags&1) {
         int sprt_frame,sprt_mirror;
-        int sel_angle = (1024 + view_a - (things[t].a<<5)) & 4095;
+        int sel_angle = (1024 + f->view_a - (things[t].a<<5)) & 4095;
         spriteSelect(sel_angle, 0, &sprt_frame,&sprt_mirror );
-        sprites[num_sprites].frame = things[t].first_frame + sprt_frame;
-        sprites[num_sprites].flags = sprt_mirror;
+        f->sprites[f->num_sprites].frame = things[t].first_frame + sprt_frame;
+        f->sprites[f->num_sprites].flags = sprt_mirror;
       } else {
-        sprites[num_sprites].frame = things[t].first_frame;
+        f->sprites[f->num_sprites].frame = things[t].first_frame;
       }
       // set owner
-      vis[vid].owner = num_sprites;
+      f->vis[vid].owner = f->num_sprites;
       // next
-      ++ num_sprites;
-      if (num_sprites == MAX_SPRITES) {
+      ++ f->num_sprites;
+      if (f->num_sprites == MAX_SPRITES) {
 #ifdef SIMULATION
-        printf("WARNING: out of sprites\n");
+        printf("WARNING: out of f->sprites\n");
 #endif
         break; // can't take any more sprites
       }
     }
   }
 #ifdef SIMULATION
-  //printf("%d sprites in frame\n",num_sprites);
+  //printf("%d sprites in frame\n",f->num_sprites);
 #endif
+  // sort near to far (insertion, few sprites)
+  for (int i = 0; i < f->num_sprites; ++i) {
+    int v    = f->num_level_vis_segs + i;
+    int dist = f->sprites[f->vis[v].owner].dist;
+    int j    = i;
+    while (j > 0 && f->sprites[f->vis[f->sprite_order[j-1]].owner].dist > dist) {
+      f->sprite_order[j] = f->sprite_order[j-1];
+      -- j;
+    }
+    f->sprite_order[j] = v;
+  }
+  // sprites by columns, near to far
+  bucket_vis(f, f->sprite_order,f->num_sprites,
+             f->sprite_bucket_begin,f->sprite_bucket_end,f->sprite_bucket_vis,
+             N_SPRITE_BUCKET_VIS);
 }
 
-// draw sprites in a screen column
-static inline void draw_sprites_column(int c)
+// draw sprites in a screen column, up to the closest opaque wall (wall_y)
+static inline void draw_sprites_column(struct frame_vis *f,int c,int core,int wall_y)
 {
-  for (int v = num_level_vis_segs; v < vis_seg_next; v++) {
-    if (c >= vis[v].i0 && c <= vis[v].i1) {
+  int b     = c >> COL_BUCKET_SHIFT;
+  int b_end = f->sprite_bucket_end[b];
+  for (int i = f->sprite_bucket_begin[b]; i < b_end; ++i) {
+    int v = f->sprite_bucket_vis[i];
+    if (f->sprites[f->vis[v].owner].dist > wall_y) {
+      break; // this one and the next ones are behind the wall
+    }
+    if (c >= f->vis[v].i0 && c <= f->vis[v].i1) {
       // perspective correct interpolation
-      int sprt       = vis[v].owner;
+      int sprt       = f->vis[v].owner;
       // -> inv distance
-      int c_delta    = c - vis[v].i0;
-      int invd       = vis[v].invd; // constant across sprite
-      int tu_invd    = vis[v].tu_invd + mul(c_delta,vis[v].tu_invd_inc);
+      int c_delta    = c - f->vis[v].i0;
+      int invd       = f->vis[v].invd; // constant across sprite
+      int tu_invd    = f->vis[v].tu_invd + mul(c_delta,f->vis[v].tu_invd_inc);
       // -> distance (view y coordinate)
-      int y          = sprites[sprt].dist;   // distance
+      int y          = f->sprites[sprt].dist;   // distance
       int tc_u       = mul(tu_invd,y) >> 19; // tex u coord
 			// -> mirrored?
-			if (sprites[sprt].flags) {
-				tc_u = sprites[sprt].w - tc_u;
+			if (f->sprites[sprt].flags) {
+				tc_u = f->sprites[sprt].w - tc_u;
 			}
       // -> sprite height
-      int sprt_sec   = sprites[sprt].sec;
-      int floor_h    = bspSectors[sprt_sec].f_h - view_z;
+      int sprt_sec   = f->sprites[sprt].sec;
+      int floor_h    = bspSectors[sprt_sec].f_h - f->view_z;
       int sprt_z_btm = to_h(floor_h,invd);
-      int sprt_z_top = to_h(floor_h + sprites[sprt].h,invd);
+      int sprt_z_top = to_h(floor_h + f->sprites[sprt].h,invd);
       // -> clamp
       int tc_v       = 0;
       if (sprt_z_btm < 0) {
@@ -721,11 +1049,11 @@ static inline void draw_sprites_column(int c)
       if (sprt_z_top >= doomchip_height) {
         sprt_z_top = doomchip_height-1;
       }
-      int tex_id = sprites[sprt].frame;
-      col_process();
-      col_send(
+      int tex_id = f->sprites[sprt].frame;
+      col_wait(core);
+      col_out(core,
         COLDRAW_WALL(y,tc_v,tc_u),
-        COLDRAW_COL(tex_id,sprt_z_btm,sprt_z_top, sprites[sprt].light) | WALL
+        COLDRAW_COL(tex_id,sprt_z_btm,sprt_z_top, f->sprites[sprt].light) | WALL
       );
     }
   }
@@ -741,12 +1069,12 @@ static inline struct p2d collision(int px,int py,int radius)
   int colx   = px;
   int coly   = py;
   int stack_ptr    = 0;
-  stack [stack_ptr] = root;
-  stack_ptr         = stack_ptr + 1;
+  collision_stack[stack_ptr] = root;
+  stack_ptr        = stack_ptr + 1;
   while (stack_ptr != 0) {
     // pop
     stack_ptr = stack_ptr - 1;
-    int n    = stack[stack_ptr];
+    int n    = collision_stack[stack_ptr];
     if ((n & 32768) == 0) {
       // tree node
       int dx  = px - bspNodes[n].x;
@@ -754,19 +1082,19 @@ static inline struct p2d collision(int px,int py,int radius)
       int csl = mul(dx , bspNodes[n].dy);
       int csr = mul(dy , bspNodes[n].dx);
       if (csr > csl) {
-        stack[stack_ptr] = bspNodes[n].rchild;
+        collision_stack[stack_ptr] = bspNodes[n].rchild;
         stack_ptr        = stack_ptr + 1;
         if (bbox_touches(px,py,radius,
                         &bspNodes[n].lbb)) {
-          stack[stack_ptr] = bspNodes[n].lchild;
+          collision_stack[stack_ptr] = bspNodes[n].lchild;
           stack_ptr        = stack_ptr + 1;
         }
       } else {
-        stack[stack_ptr]  = bspNodes[n].lchild;
+        collision_stack[stack_ptr]  = bspNodes[n].lchild;
         stack_ptr         = stack_ptr + 1;
         if (bbox_touches(px,py,radius,
                         &bspNodes[n].rbb)) {
-          stack[stack_ptr] = bspNodes[n].rchild;
+          collision_stack[stack_ptr] = bspNodes[n].rchild;
           stack_ptr        = stack_ptr + 1;
         }
       }
@@ -817,10 +1145,11 @@ static inline void terrain(
   int view_x, int view_y, int view_z,      /// TODO: clean up unused params
   int start_x,int start_y,int start_dist,
   int end_x,  int end_y,  int end_dist,
-  int btm,    int top,    int col)
+  int btm,    int top,    int col,
+  int core)
 {
   int pick = (col == 160 && start_dist == 0) ? PICK : 0;
-  col_send(
+  col_out(core,
     COLDRAW_TERRAIN(start_dist,end_dist,pick),
     COLDRAW_COL    (terrain_texture_id, btm, top, 15) | TERRAIN
   );
@@ -828,265 +1157,351 @@ static inline void terrain(
 
 // -----------------------------------------------------
 
-// draws all screen columns
-static inline void draw_columns()
+// draws a screen column, core 0 sends to the GPU, core 1 to the ring
+static void draw_column(struct frame_vis *f,int c,int core) // not inlined, called by both cores
 {
-  for (int c = 0 ; c != doomchip_width ; ++c) {
 //#ifdef SIMULATION
 //  printf("Column %d -------------------------\n",c);
 //#endif
 
-    int prev_x    = view_x;
-    int prev_y    = view_y;
-    int prev_dist = 0;
-    int sin_view  = sin_m[(col_to_alpha[c] + 1024) & 4095];
-    int inv_sw    = div(1<<FPm,sin_view);             // TODO: precomp!!!
-
-    int colangle  = view_a + col_to_alpha[c];
-    int ray_dy    = sin_m[ colangle         & 4095];
-    int ray_dx    = sin_m[(colangle + 1024) & 4095];
-
-    // pre-mult for perspective distance correction
-    ray_dx        = mul(ray_dx,inv_sw);
-    ray_dy        = mul(ray_dy,inv_sw);
-    col_send(
-      PARAMETER_RAY_CS(ray_dx,ray_dy),
-      PARAMETER
-    );
-    // apply view rotation to flats (planes)
-    int rz = 4096;
-    int cx = col_to_x[c];
-    int du = dot3( cx,0,rz,  cosview,0,sinview ) >> 14;
-    int dv = dot3( cx,0,rz, -sinview,0,cosview ) >> 14;
-    col_send(
-      PARAMETER_PLANE_A(256,0,0), // ny,uy,vy
-      PARAMETER_PLANE_A_EX(du,dv) | PARAMETER
-    );
-
-    // init top/btm
-    int top       = doomchip_height - 1;
-    int btm       = 0;
-
-    // for each vis sub-sector
-    int v = 0;
-    int v_end;
-    for (int ssc = 0; ssc < vis_ssec_next && top > btm ; ++ssc, v = v_end) {
+  int prev_x    = f->view_x;
+  int prev_y    = f->view_y;
+  int prev_dist = 0;
+  int inv_sw    = col_inv_sw[c];
+
+  int colangle  = f->view_a + col_to_alpha[c];
+  int ray_dy    = sin_m[ colangle         & 4095];
+  int ray_dx    = sin_m[(colangle + 1024) & 4095];
+
+  // pre-mult for perspective distance correction
+  ray_dx        = mul(ray_dx,inv_sw);
+  ray_dy        = mul(ray_dy,inv_sw);
+  col_out(core,
+    PARAMETER_RAY_CS(ray_dx,ray_dy),
+    PARAMETER
+  );
+  // apply view rotation to flats (planes)
+  int rz = 4096;
+  int cx = col_to_x[c];
+  int du = dot3( cx,0,rz,  f->cosview,0,f->sinview ) >> 14;
+  int dv = dot3( cx,0,rz, -f->sinview,0,f->cosview ) >> 14;
+  col_out(core,
+    PARAMETER_PLANE_A(256,0,0), // ny,uy,vy
+    PARAMETER_PLANE_A_EX(du,dv) | PARAMETER
+  );
 
-      v_end = v + vis_len[ssc];
+  // init top/btm
+  int top       = doomchip_height - 1;
+  int btm       = 0;
+#ifdef SPRITES
+  // depth of the closest opaque wall, hides the sprites behind
+  int wall_y    = 0x7fffffff;
+#endif
 
-      if (c >= vis_p0[ssc]) { if (c <= vis_p1[ssc]) {
+  // for each vis segment in the bucket of the column, front to back
+  int b     = c >> COL_BUCKET_SHIFT;
+  int b_end = f->col_bucket_end[b];
+  for (int i = f->col_bucket_begin[b]; i < b_end && top > btm ; ++i) {
 
-      // for each vis segment
-      for ( ; v < v_end ; ++v ) {
+    int v = f->col_bucket_segs[i];
 
-        if (c >= vis[v].i0 && c <= vis[v].i1) {
+    if (c >= f->vis[v].i0 && c <= f->vis[v].i1) {
 
-          int sec        = bspSSectors[vis_ssecs[ssc]].parentsec;
-          int seg        = vis[v].owner;
+      int ssc        = f->vis[v].ssc;
+      int sec        = bspSSectors[f->vis_ssecs[ssc]].parentsec;
+      int seg        = f->vis[v].owner;
 #ifdef SPRITES
-          // tag sector as visible
-          sec_vis_add(sec);
+      // tag sector as visible
+      sec_vis_add(f,sec);
 #endif
-          // perspective correct interpolation
-          // -> inv distance
-          int c_delta    = c - vis[v].i0;
-          int invd       = vis[v].invd    + mul(c_delta,vis[v].invd_inc);
-          int tu_invd    = vis[v].tu_invd + mul(c_delta,vis[v].tu_invd_inc);
-          // -> distance (view y coordinate)
-          int y          = div( 1<<25     , invd );       // distance
-          int tc_u       = mul(tu_invd,y) >> 19; // tex u coord
-          int y_low      = y>>3;
-          // hit point
-          int hit_dist   = mul(y_low,inv_sw);
-          int hit_x      = view_x + (mul(ray_dx,y_low) >> FPm);
-          int hit_y      = view_y + (mul(ray_dy,y_low) >> FPm);
-          // sector light
-          int seclight = vis_seclight[ssc];
-          // sector floor/ceiling height
-          int sec_f_h = bspSectors[sec].f_h - view_z;
-          int sec_c_h = bspSectors[sec].c_h - view_z;
-          int f_h     = to_h(sec_f_h,invd);
-          int c_h     = to_h(sec_c_h,invd);
-          // process pending column commands
-          col_process();
-          // adjust tex coord
-          int tex_v_f = 0;
-          if (btm > f_h) {
-            tex_v_f = mul((btm - f_h),y) >> DEPTH_SHIFT;
-            f_h     = btm;
-          } else if (top < f_h) {
-            tex_v_f = mul((f_h - top),y) >> DEPTH_SHIFT;
-            f_h     = top;
-          }
-          if (btm > c_h) {
-            c_h     = btm;
-          } else if (top < c_h) {
-            c_h     = top;
-          }
-
-          // floor or terrain?
-          if (bspSectors[sec].f_T) {
-            // floor with planar texturing
-            int is_terrain = bspSectors[sec].f_T == TERRAIN_ID;
-            if (!is_terrain) {
-              col_send(
-                COLDRAW_PLANE_B(-sec_f_h,btm-(doomchip_height>>1)),
-                COLDRAW_COL(bspSectors[sec].f_T, btm,f_h, seclight) | PLANE
-              );
-            } else {
-              // trace terrain
-              terrain(view_x,view_y,view_z,
-                      prev_x,prev_y,prev_dist,
-                      hit_x,hit_y,hit_dist,
-                      btm,top, c);
-            }
-          }
-          btm       = f_h;
+      // perspective correct interpolation
+      // -> inv distance
+      int c_delta    = c - f->vis[v].i0;
+      int invd       = f->vis[v].invd    + mul(c_delta,f->vis[v].invd_inc);
+      int tu_invd    = f->vis[v].tu_invd + mul(c_delta,f->vis[v].tu_invd_inc);
+      // -> distance (view y coordinate)
+      int y          = recip(invd);          // distance
+      int tc_u       = mul(tu_invd,y) >> 19; // tex u coord
+      int y_low      = y>>3;
+      // hit point
+      int hit_dist   = mul(y_low,inv_sw);
+      int hit_x      = f->view_x + (mul(ray_dx,y_low) >> FPm);
+      int hit_y      = f->view_y + (mul(ray_dy,y_low) >> FPm);
+      // sector light
+      int seclight = f->vis_seclight[ssc];
+      // sector floor/ceiling height
+      int sec_f_h = bspSectors[sec].f_h - f->view_z;
+      int sec_c_h = bspSectors[sec].c_h - f->view_z;
+      int f_h     = to_h(sec_f_h,invd);
+      int c_h     = to_h(sec_c_h,invd);
+      // process pending column commands
+      col_wait(core);
+      // adjust tex coord
+      int tex_v_f = 0;
+      if (btm > f_h) {
+        tex_v_f = mul((btm - f_h),y) >> DEPTH_SHIFT;
+        f_h     = btm;
+      } else if (top < f_h) {
+        tex_v_f = mul((f_h - top),y) >> DEPTH_SHIFT;
+        f_h     = top;
+      }
+      if (btm > c_h) {
+        c_h     = btm;
+      } else if (top < c_h) {
+        c_h     = top;
+      }
 
-          // ceiling with planar texturing
-          col_send(
-            COLDRAW_PLANE_B( sec_c_h,c_h-(doomchip_height>>1)),
-            COLDRAW_COL(bspSectors[sec].c_T, c_h,top, seclight) | PLANE
+      // floor or terrain?
+      if (bspSectors[sec].f_T) {
+        // floor with planar texturing
+        int is_terrain = bspSectors[sec].f_T == TERRAIN_ID;
+        if (!is_terrain) {
+          col_out(core,
+            COLDRAW_PLANE_B(-sec_f_h,btm-(doomchip_height>>1)),
+            COLDRAW_COL(bspSectors[sec].f_T, btm,f_h, seclight) | PLANE
           );
-          top       = c_h;
-
-          int other = bspSegs[seg].other_sec;
-
-          // lower wall
-          if (bspSegs[seg].lwr) {
-            int is_terrain = bspSegs[seg].lwr == TERRAIN_ID;
-            int sec_f_o    = bspSectors[other].f_h - view_z;
-            int f_o        = to_h(sec_f_o,invd);
-            if (btm < f_o) {   // the lower wall is visible
-              if (top < f_o) { // clip to top
-                f_o = top;
-              }
-              if (!is_terrain) {
-                  col_send(
-                    COLDRAW_WALL(y,tex_v_f,tc_u),
-                    COLDRAW_COL(bspSegs[seg].lwr, btm,f_o, seclight) | WALL
-                  );
-              } else if (hit_dist > prev_dist) {
-                // trace terrain
-                terrain(view_x,view_y,view_z,
-                        prev_x,prev_y,prev_dist,
-                        hit_x,hit_y,((2<<12)-1),
-                        btm,f_o, c);
-                // background filler
-                col_send(
-                  COLDRAW_WALL(Y_MAX,0,0),
-                  COLDRAW_COL(0, btm,f_o, 15) | WALL
-                );
-              }
-              btm            = f_o;
-            }
-          }
+        } else {
+          // trace terrain
+          terrain(f->view_x,f->view_y,f->view_z,
+                  prev_x,prev_y,prev_dist,
+                  hit_x,hit_y,hit_dist,
+                  btm,top, c, core);
+        }
+      }
+      btm       = f_h;
 
-          // process pending column commands
-          col_process();
-
-          // upper wall
-          if (bspSegs[seg].upr) {
-            int is_terrain = bspSegs[seg].upr == TERRAIN_ID;
-            int sec_c_o    = bspSectors[other].c_h - view_z;
-            int c_o        = to_h(sec_c_o,invd);
-            int tex_v      = 0;
-            if (top > c_o) {    // the upper wall is visible
-              if (btm > c_o) {  // clip to bottom
-                tex_v   = mul((btm - c_o),y) >> DEPTH_SHIFT;
-                c_o     = btm;
-              }
-              if (!is_terrain) {
-                col_send(
-                  COLDRAW_WALL(y,tex_v,tc_u),
-                  COLDRAW_COL(bspSegs[seg].upr, c_o,top, seclight) | WALL
-                );
-              } else if (hit_dist > prev_dist) {
-                // trace terrain
-                terrain(view_x,view_y,view_z,
-                        prev_x,prev_y,prev_dist,
-                        hit_x,hit_y,((2<<12)-1),
-                        c_o,top, c);
-                // background filler
-                col_send(
-                  COLDRAW_WALL(Y_MAX,0,0),
-                  COLDRAW_COL(0, c_o,top, 15) | WALL
-                );
-              }
-              top            = c_o;
-            }
+      // ceiling with planar texturing
+      col_out(core,
+        COLDRAW_PLANE_B( sec_c_h,c_h-(doomchip_height>>1)),
+        COLDRAW_COL(bspSectors[sec].c_T, c_h,top, seclight) | PLANE
+      );
+      top       = c_h;
+
+      int other = bspSegs[seg].other_sec;
+
+      // lower wall
+      if (bspSegs[seg].lwr) {
+        int is_terrain = bspSegs[seg].lwr == TERRAIN_ID;
+        int sec_f_o    = bspSectors[other].f_h - f->view_z;
+        int f_o        = to_h(sec_f_o,invd);
+        if (btm < f_o) {   // the lower wall is visible
+          if (top < f_o) { // clip to top
+            f_o = top;
           }
-
-          // middle wall
-          if (bspSegs[seg].mid) {
-            int is_terrain = bspSegs[seg].mid == TERRAIN_ID;
-            if (!is_terrain) {
-              col_send(
+          if (!is_terrain) {
+              col_out(core,
                 COLDRAW_WALL(y,tex_v_f,tc_u),
-                COLDRAW_COL(bspSegs[seg].mid, f_h,c_h, seclight) | WALL
-              );
-              // close column?
-              if ((bspSegs[seg].flags&1) == 0) {
-                //              ^^^^^ transparent if flags&1
-                top = btm; // opaque, close column
-                break;
-              }
-            } else if (hit_dist > prev_dist) {
-              // trace terrain
-              terrain(view_x,view_y,view_z,
-                      prev_x,prev_y,prev_dist,
-                      hit_x,hit_y,((2<<12)-1),
-                      f_h,c_h, c);
-              // background filler
-              col_send(
-                COLDRAW_WALL(Y_MAX,0,0),
-                COLDRAW_COL(0, f_h,c_h, 15) | WALL
+                COLDRAW_COL(bspSegs[seg].lwr, btm,f_o, seclight) | WALL
               );
-              // terrain is the last thing we render
-              top = btm;
-              break;
-            }
+          } else if (hit_dist > prev_dist) {
+            // trace terrain
+            terrain(f->view_x,f->view_y,f->view_z,
+                    prev_x,prev_y,prev_dist,
+                    hit_x,hit_y,((2<<12)-1),
+                    btm,f_o, c, core);
+            // background filler
+            col_out(core,
+              COLDRAW_WALL(Y_MAX,0,0),
+              COLDRAW_COL(0, btm,f_o, 15) | WALL
+            );
           }
+          btm            = f_o;
+        }
+      }
 
-          // terrain hits
-          if (hit_dist > prev_dist) {
-            // ^^^^^^^^^^^^^^^^^^^ segments are not sorted within a sector
-            // so we may process a segment located in front after we already
-            // advanced to the background
-            // track hit points
-            prev_x    = hit_x;
-            prev_y    = hit_y;
-            prev_dist = hit_dist;
+      // process pending column commands
+      col_wait(core);
+
+      // upper wall
+      if (bspSegs[seg].upr) {
+        int is_terrain = bspSegs[seg].upr == TERRAIN_ID;
+        int sec_c_o    = bspSectors[other].c_h - f->view_z;
+        int c_o        = to_h(sec_c_o,invd);
+        int tex_v      = 0;
+        if (top > c_o) {    // the upper wall is visible
+          if (btm > c_o) {  // clip to bottom
+            tex_v   = mul((btm - c_o),y) >> DEPTH_SHIFT;
+            c_o     = btm;
+          }
+          if (!is_terrain) {
+            col_out(core,
+              COLDRAW_WALL(y,tex_v,tc_u),
+              COLDRAW_COL(bspSegs[seg].upr, c_o,top, seclight) | WALL
+            );
+          } else if (hit_dist > prev_dist) {
+            // trace terrain
+            terrain(f->view_x,f->view_y,f->view_z,
+                    prev_x,prev_y,prev_dist,
+                    hit_x,hit_y,((2<<12)-1),
+                    c_o,top, c, core);
+            // background filler
+            col_out(core,
+              COLDRAW_WALL(Y_MAX,0,0),
+              COLDRAW_COL(0, c_o,top, 15) | WALL
+            );
           }
+          top            = c_o;
+        }
+      }
 
-        } // intersection
+      // middle wall
+      if (bspSegs[seg].mid) {
+        int is_terrain = bspSegs[seg].mid == TERRAIN_ID;
+        if (!is_terrain) {
+          col_out(core,
+            COLDRAW_WALL(y,tex_v_f,tc_u),
+            COLDRAW_COL(bspSegs[seg].mid, f_h,c_h, seclight) | WALL
+          );
+          // close column?
+          if ((bspSegs[seg].flags&1) == 0) {
+            //              ^^^^^ transparent if flags&1
+#ifdef SPRITES
+            wall_y = y;
+#endif
+            top = btm; // opaque, close column
+            break;
+          }
+        } else if (hit_dist > prev_dist) {
+          // trace terrain
+          terrain(f->view_x,f->view_y,f->view_z,
+                  prev_x,prev_y,prev_dist,
+                  hit_x,hit_y,((2<<12)-1),
+                  f_h,c_h, c, core);
+          // background filler
+          col_out(core,
+            COLDRAW_WALL(Y_MAX,0,0),
+            COLDRAW_COL(0, f_h,c_h, 15) | WALL
+          );
+          // terrain is the last thing we render
+          top = btm;
+          break;
+        }
+      }
 
-      } // vis segments
+      // terrain hits
+      if (hit_dist > prev_dist) {
+        // ^^^^^^^^^^^^^^^^^^^ segments are not sorted within a sector
+        // so we may process a segment located in front after we already
+        // advanced to the background
+        // track hit points
+        prev_x    = hit_x;
+        prev_y    = hit_y;
+        prev_dist = hit_dist;
+      }
 
-      }} // active sector
+    } // intersection
 
-    } // vis sub-sectors
+  } // vis segments
 
 #ifdef SPRITES
-    // render sprite columns
-    draw_sprites_column(c);
+  // render sprite columns
+  draw_sprites_column(f,c,core,wall_y);
 #endif
 
-    // take a deep breath
-    col_process();
+  // take a deep breath
+  col_wait(core);
 
-    if (btm < top) {
-      // still open, add a filler with sky texture (id == 0)
-      col_send(
-              COLDRAW_WALL(Y_MAX,0,0),
-              COLDRAW_COL(0, btm, top, 15) | WALL
-            );
+  if (btm < top) {
+    // still open, add a filler with sky texture (id == 0)
+    col_out(core,
+            COLDRAW_WALL(Y_MAX,0,0),
+            COLDRAW_COL(0, btm, top, 15) | WALL
+          );
+  }
+
+  // send end of column
+  col_out(core,0, COLDRAW_EOC);
+
+}
+
+// lets core 1 start: it first computes the visibility of the next frame,
+// then joins on the odd columns of the current one. Frame data must stay
+// untouched until draw_columns returns
+static inline void draw_columns_start()
+{
+  col_ring_head = 0;
+  col_ring_tail = 0;
+  core1_join    = 0;
+  core1_first   = 0;
+  core1_done    = 0;
+  core1_todo    = 1;
+}
+
+// draws all screen columns, core 1 takes the odd ones from the column
+// where it joins
+static inline void draw_columns(struct frame_vis *f)
+{
+  for (int c = 0 ; c != doomchip_width ; ++c) {
+    if (c & 1) {
+      if (core1_first == 0 && core1_join) {
+        // hand over from the next odd column, core 1 gets a head start
+        core1_first = c + 2;
+      }
+      if (core1_first != 0 && c >= core1_first) {
+        col_forward();
+        continue;
+      }
     }
+    draw_column(f,c,0);
+  }
+  if (core1_first == 0) {
+    core1_first = doomchip_width; // too late, no column left for core 1
+  }
+  while (core1_done != 1) { } // core 1 is done with the frame data
+  memory_barrier();
+}
 
-    // send end of column
-    col_send(0, COLDRAW_EOC);
+// -----------------------------------------------------
+// Frames
+// -----------------------------------------------------
 
-  } // c
+// sets the viewpoint of a frame from the player (core 0)
+static inline void frame_view(struct frame_vis *f,int frame_num)
+{
+  f->view_x = view_x;
+  f->view_y = view_y;
+  f->view_a = view_a;
+  f->frame  = frame_num;
+  f->rand   = rand;
+
+  { // get frustum
+    int angle   = view_a;
+    f->sinview  = sin_m[ angle         & 4095];
+    f->cosview  = sin_m[(angle + 1024) & 4095];
+    angle       = view_a + col_to_alpha[0];
+    f->sinleft  = sin_m[ angle         & 4095];
+    f->cosleft  = sin_m[(angle + 1024) & 4095];
+    angle       = view_a + col_to_alpha[doomchip_width-1];
+    f->sinright = sin_m[ angle         & 4095];
+    f->cosright = sin_m[(angle + 1024) & 4095];
+  }
+
+  { // adjust view altitude
+    int player_sec = find_sector(view_x,view_y);
+    if (bspSectors[player_sec].f_T != TERRAIN_ID) {
+      view_z    = bspSectors[player_sec].f_h + 30;
+    } else {
+      view_z    = terrainh() - terrain_z_offset + 30;
+    }
+    f->view_z = view_z;
+  }
+}
+
+// computes the visibility of a frame (core 1, except for the first frame)
+static void frame_visibility(struct frame_vis *f) // not inlined, called by both cores
+{
+  // reset vis segments
+  f->vis_seg_next = 0;
+
+  // potential visible set from BSP
+  bsp_pvs(f);
+
+#ifdef SPRITES
+  // add sprites (using visibility from when this buffer was last drawn)
+  add_sprites(f);
+  // reset sprite visibility
+  sec_vis_reset(f);
+#endif
 }
 
 // -----------------------------------------------------
@@ -1095,8 +1510,31 @@ static inline void draw_columns()
 
 void main_1()
 {
-  // hangs core 1 (we don't use it yet!)
-  while (1) { }
+  core1_todo = 0;
+  core1_done = 0;
+
+  while (1) {
+
+    // wait for the order
+    while (core1_todo == 0) { }
+    core1_todo = 0;
+    memory_barrier();
+    struct frame_vis *f_draw = fv_draw;
+    struct frame_vis *f_next = fv_next;
+    // visibility of the next frame, while core 0 draws the current one
+    frame_visibility(f_next);
+    // join on the columns, wait for core 0 to hand over
+    core1_join = 1;
+    while (core1_first == 0) { }
+    // build the odd columns, core 0 forwards them
+    for (int c = core1_first ; c < doomchip_width ; c += 2) {
+      draw_column(f_draw,c,1);
+    }
+    // sync
+    memory_barrier();
+    core1_done = 1;
+
+  }
 }
 
 void main_0()
@@ -1112,8 +1550,10 @@ void main_0()
   view_a   = 0; //player_start_a + 128;
   frame    = 0;
   rand     = 3137;
+  recip_pre();
 #ifdef SPRITES
-  sec_vis_reset();
+  sec_vis_reset(fv_draw);
+  sec_vis_reset(fv_next);
 #endif
 
   // --------------------------
@@ -1122,62 +1562,46 @@ void main_0()
   oled_init();
   oled_fullscreen();
 
+  // --------------------------
+  // visibility of the first frame
+  // --------------------------
+  frame_view(fv_next,frame);
+  frame_visibility(fv_next);
+
   // --------------------------
   // render loop
   // --------------------------
   while (1) {
 
-		{ // get frustum
-      int angle = view_a;
-      sinview   = sin_m[ angle         & 4095];
-      cosview   = sin_m[(angle + 1024) & 4095];
-      angle     = view_a + col_to_alpha[0];
-      sinleft   = sin_m[ angle         & 4095];
-      cosleft   = sin_m[(angle + 1024) & 4095];
-      angle     = view_a + col_to_alpha[doomchip_width-1];
-      sinright  = sin_m[ angle         & 4095];
-      cosright  = sin_m[(angle + 1024) & 4095];
-		}
-
-		{ // adjust view altitude
-      int player_sec = find_sector(view_x,view_y);
-      if (bspSectors[player_sec].f_T != TERRAIN_ID) {
-        view_z    = bspSectors[player_sec].f_h + 30;
-      } else {
-        view_z    = terrainh() - terrain_z_offset + 30;
-      }
-		}
-
-    // reset vis segments
-    vis_seg_next = 0;
+    // swap, the next frame becomes the current one
+    struct frame_vis *tmp = fv_draw;
+    fv_draw = fv_next;
+    fv_next = tmp;
 
-    // potential visible set from BSP
-    bsp_pvs();
+    // viewpoint of the next frame, from the player as of now
+    frame_view(fv_next,frame + 1);
 
-#ifdef SPRITES
-    // add sprites (using visibility from previous frame)
-    add_sprites();
-    // reset sprite visibnility
-    sec_vis_reset();
-#endif
+    // core 1 computes the visibility of the next frame, then builds
+    // columns, while the previous frame completes
+    draw_columns_start();
 
     // before drawing cols wait for previous frame
     while ((userdata()&4) == 0) { /*wait*/ }
 
     // setup view
     col_send(
-      PARAMETER_VIEW_Z( view_z + terrain_z_offset ),
-      //                          ^^^^
-      //                          global offset on terrain altitude
+      PARAMETER_VIEW_Z( fv_draw->view_z + terrain_z_offset ),
+      //                                   ^^^^
+      //                                   global offset on terrain altitude
       PARAMETER
     );
     col_send(
-      PARAMETER_UV_OFFSET( view_x<<10 ),
-      PARAMETER_UV_OFFSET_EX( view_y<<10 ) | PARAMETER
+      PARAMETER_UV_OFFSET( fv_draw->view_x<<10 ),
+      PARAMETER_UV_OFFSET_EX( fv_draw->view_y<<10 ) | PARAMETER
     );
 
     // draw screen columns
-    draw_columns();
+    draw_columns(fv_draw);
 
     // update rand seed
     rand   = rand * 31421 + 6927;
@@ -1190,8 +1614,8 @@ void main_0()
       view_a += 54;
     }
     if (btn_fwrd()) {
-      view_x += cosview>>8;
-      view_y += sinview>>8;
+      view_x += fv_draw->cosview>>8;
+      view_y += fv_draw->sinview>>8;
     }
 
 #if 1
@@ -1203,8 +1627,8 @@ void main_0()
         view_a -= (rand&127);
       }
     }
-    view_x += cosview>>8;
-    view_y += sinview>>8;
+    view_x += fv_draw->cosview>>8;
+    view_y += fv_draw->sinview>>8;
 #endif
 
     // uncollide
@@ -8,6 +8,8 @@
 // |                                                                           |
 // |  Use arrows for movement, PgUp and PgDwn for looking up/down,             |
 // |  use Home/End for moving up/down.                                         |
+// |  Press forward and backward together to cycle through the maps of the     |
+// |  data pack.                                                               |
 // |                                                                           |
 // | @sylefeb 2022-08-15  licence: GPL v3, see full text in repo               |
 // |___________________________________________________________________________|
@@ -22,9 +24,6 @@
 #include "raster.c"
 #include "frustum.c"
 
-// This file is autogenerated from a bsp level by the qrepack tool.
-#include "q.h"
-
 // #define DEBUG
 // ^^^^^^^^^^^^ uncomment to get profiling info over UART
 
@@ -34,41 +33,123 @@ const int z_clip = 128; // near z clipping plane
 
 typedef struct {
   rconvex_texturing rtex;
-  unsigned char nrm_id;
-  unsigned char tvc_id;
-  unsigned char tex_id;
-  unsigned char lmap_id;
   int lu_offs,lv_offs;
+  unsigned short nrm_id;
+  unsigned short tvc_id;
+  unsigned short tex_id;  // mip level already applied
+  unsigned short lmap_id;
+  unsigned char  mip;     // u,v are scaled down by 1<<mip
+  unsigned char  pad[3];  // 32 bytes, keeps the ints aligned (pack(1))
 } t_qrtexs;
 
 // array of texturing data
 #define MAX_RASTER_FACES 400
 t_qrtexs          rtexs[MAX_RASTER_FACES];
 
+// -----------------------------------------------------
+// Pack manifest
+// -----------------------------------------------------
+
+// The data pack is described by a manifest produced by the qrepack tool.
+// Its flash address is stored in the unused bytes 4..7 of the first texture
+// table entry, at the start of the pack (the sampler only reads bytes 0..3).
+// The manifest lists the maps of the pack, each map has its section offsets,
+// limits, normals, texturing vectors and start view. Everything sized by
+// the map lives in the arena, so a new pack only needs a flash write.
+
+#define PACK_LOCATOR     ((2<<20) + 4)
+#define PACK_MAGIC       0x504b3551 // 'Q5KP'
+#define PACK_VERSION     4
+#define MAP_FLAG_VIS_RLE 1 // vislists in run-length form, see readLeafVisListRLE
+#define MAP_FLAG_MIPS    2 // game textures have their mip levels, see faceMip
+#define MAP_FLAG_FACES   4 // per leaf face masks, see readFaceMasks
+#define MAP_FLAG_GIDS    8 // leaves carry global vertex ids, see vtx_slot
+#define NUM_MIPS         4
+#define LEAF_FORMAT      4
+#define MAX_MAPS         16
+#define ARENA_SIZE       (14*1024)  // bytes, see arena below, qrepack checks its maps fit
+
+typedef struct { p3d vecS; short distS; p3d vecT; short distT; } t_texvecs;
+typedef struct { unsigned short plane_id; unsigned short front; unsigned short back; aabb box; } t_my_node;
+typedef struct { short nx, ny, nz; int dist; } t_my_plane;
+
+typedef struct {
+  int magic;
+  int version;
+  int stamp;    // changes with the pack content, see check_pack
+  int num_maps;
+} t_pack_manifest;
+
+typedef struct {
+  int leaf_format;
+  int flags;
+  int o_bsp_nodes;
+  int o_bsp_planes;
+  int o_vislist;
+  int o_leaf_offsets;
+  int o_vis_offsets;   // leaf offsets as indexed by vislist entries
+  int n_max_vislen;
+  int n_max_vis_bytes; // max run-length vislist size, in bytes
+  int n_max_verts;
+  int n_max_leaf_size;
+  int n_normals;
+  int n_texvecs;
+  int mip_dist;        // plane distance where a texel covers a pixel
+  int o_face_masks;    // face mask (start, length) by leaf id
+  int n_max_mask_bytes;
+  p3d view;
+  short pad;
+  // followed by normals (p3d, padded to 4 bytes), then texvecs
+} t_map_manifest;
+
+t_pack_manifest pack_mfst;
+int             map_addrs[MAX_MAPS];
+t_map_manifest  mfst;        // current map
+int             map_current;
+int             map_request; // map to switch to between frames, -1 if none
+
+p3d view; // view position, starts at the map start view
+
+// SPRAM budget: code and static data from 0x4 up, the stack of core 1 below
+// 127996 (0x1F3FC, see crt0.s), the stack of core 0 above it. The arena gets
+// what the rest leaves: ~22KB of code, ~85KB of static data (span_pool alone
+// is 60000 bytes) and 2KB for the stack of core 1.
+int  arena[ARENA_SIZE>>2]; // buffers sized by the current map
+
 // -----------------------------------------------------
 
 // array of projected vertices
-p2d prj_vertices_0[n_max_verts];
-p2d prj_vertices_1[n_max_verts];
+p2d *prj_vertices_0;
+p2d *prj_vertices_1;
 
 // raster face ids within frame
 volatile int rface_next_id_0;
 volatile int rface_next_id_1;
 
+// array of normals and texturing vectors (read from the manifest)
+p3d       *normals;
+t_texvecs *texvecs;
 // array of transformed normals
-p3d       trsf_normals[n_normals];
+p3d       *trsf_normals;
+// array of dot products between view position and normals (world space)
+int       *view_dots;
 // array of transformed texturing vectors
-t_texvecs trsf_texvecs[n_texvecs];
+t_texvecs *trsf_texvecs;
 
 // frustum
 frustum frustum_view; // frustum in view space
 frustum frustum_trsf; // frustum transformed in world space
 
-unsigned short vislist[n_max_vislen]; // stores the current vislist
+unsigned short *vislist; // stores the current vislist
+unsigned char  *vis_rle; // run-length vislist, see readLeafVisListRLE
+unsigned short *vis_pos; // position of vislist entries in the run-length list
+
+unsigned char  *face_masks;      // face masks of the view leaf, see readFaceMasks
+int             face_masks_leaf; // leaf they belong to, -1 if none
 
-#define memchunk_size (8+(n_max_leaf_size>>1))
-int memchunk[memchunk_size]; // a memory chunk to load data in and work with
-//              ^^^^ we have to hold two leafs (core0/core1)
+int  memchunk_half;
+int *memchunk; // a memory chunk to load data in and work with
+//   ^^^^ we have to hold two leafs (core0/core1), one per half
 
 // -----------------------------------------------------
 
@@ -139,6 +220,11 @@ unsigned int tm_colprocess;
 unsigned int tm_srfspan;
 unsigned int tm_api;
 unsigned int num_clipped;
+unsigned int num_backfaces;
+unsigned int num_mip_faces[NUM_MIPS];
+unsigned int num_masked_faces;
+unsigned int num_masked_leaves;
+unsigned int num_vtx_transforms;
 #endif
 
 // -----------------------------------------------------
@@ -218,11 +304,8 @@ static inline void inv_transform(short *x, short *y, short *z, short w)
 
 static inline void project(const p3d* pt, p2d *pr)
 {
-  // perspective z division
-	int z     = (int)pt->z;
-  int inv_z = z != 0 ? ((1 << 16) / z) : (1 << 16);
-  pr->x = (short)((((int)pt->x * inv_z) >> 8) + SCREEN_WIDTH  / 2);
-  pr->y = (short)((((int)pt->y * inv_z) >> 8) + SCREEN_HEIGHT / 2);
+  // perspective z 'division', uses the reciprocal table
+  raster_project(pt, pr);
 }
 
 static inline void unproject(const p2d *pr,short z,p3d* pt)
@@ -234,100 +317,180 @@ static inline void unproject(const p2d *pr,short z,p3d* pt)
 
 // -----------------------------------------------------
 
-void render_spans(int c, int ispan)
+// Selects the mip level of a face from its plane distance: level k is used
+// once a texel covers less than 1/2^k pixel (faces at grazing angles keep
+// a finer level than needed, never a coarser one)
+static inline int faceMip(int ded)
+{
+  int mip = 0;
+  if (mfst.flags & MAP_FLAG_MIPS) {
+    while (mip < NUM_MIPS - 1 && ded >= (mfst.mip_dist << (mip + 1))) { ++mip; }
+  }
+  return mip;
+}
+
+// -----------------------------------------------------
+// Span registers ring buffer: core 1 walks the span lists and computes the
+// registers of each span ahead of time, core 0 streams them to the GPU
+// -----------------------------------------------------
+
+#pragma pack(push,4) // hot path, keep the ints aligned
+typedef struct {
+  int            du, dv, dr;
+  int            ded;
+  int            u_offs, v_offs;   // texture
+  int            lu_offs,lv_offs;  // light map
+  short          ny, uy, vy;
+  unsigned short tid, lid;
+  unsigned char  ys, ye;
+  unsigned char  eoc;              // 1: end of column, 2: end of empty column
+  unsigned char  mip;              // texture u,v shift (not the light map)
+} t_span_regs;
+#pragma pack(pop)
+
+#define SPAN_RING_SIZE 16 // power of two, the producer stays close ahead
+t_span_regs  span_ring[SPAN_RING_SIZE];
+volatile int span_ring_head; // next slot written by core 1 (producer)
+volatile int span_ring_tail; // next slot read by core 0 (consumer)
+
+// ensures the compiler keeps ring writes/reads on the right side of the
+// head/tail updates (the hardware itself does not reorder)
+#define memory_barrier() asm volatile ("" : : : "memory")
+
+// waits for a free slot
+static inline t_span_regs *span_ring_alloc()
+{
+  while (((span_ring_head + 1) & (SPAN_RING_SIZE-1)) == span_ring_tail) { }
+  return span_ring + span_ring_head;
+}
+
+// publishes the slot returned by span_ring_alloc
+static inline void span_ring_push()
+{
+  memory_barrier();
+  span_ring_head = (span_ring_head + 1) & (SPAN_RING_SIZE-1);
+}
+
+// -----------------------------------------------------
+
+// Computes the span registers of a column (runs on core 1)
+void produce_spans(int c)
 {
   // pixel pos (x,z)
   int rz = 256;
   int rx = c - SCREEN_WIDTH / 2;
-  // go through span list
-  while (ispan) {
-    t_span *span = span_pool + ispan;
-    // pixel pos (y)
-    int ry = span->ys - SCREEN_HEIGHT / 2;
-
+  // go through lists
+  int empty = 1;
+  for (int l = 0; l < 2; ++l) {
+    unsigned short ispan = l == 0 ? span_heads_0[c] : span_heads_1[c];
+    empty = empty & !ispan;
+    while (ispan) {
+      const t_span *span = span_pool + ispan;
+      // pixel pos (y)
+      int ry = span->ys - SCREEN_HEIGHT / 2;
+#ifdef DEBUG
+      unsigned int tm_ss = time();
+#endif
+      // surface_setup_span_nuv
+      const t_qrtexs *qrtex = &rtexs[span->fid];
+      const p3d *n = &trsf_normals[qrtex->nrm_id];
+      const p3d *u = &trsf_texvecs[qrtex->tvc_id].vecS;
+      const p3d *v = &trsf_texvecs[qrtex->tvc_id].vecT;
+      t_span_regs *r = span_ring_alloc();
+      r->ny      = n->y;
+      r->uy      = u->y;
+      r->vy      = v->y;
+      r->dr      = dot3( rx,ry,rz, n->x,n->y,n->z )>>8;
+      r->du      = dot3( rx,ry,rz, u->x,u->y,u->z )>>8;
+      r->dv      = dot3( rx,ry,rz, v->x,v->y,v->z )>>8;
+      r->ded     = qrtex->rtex.ded;
+      r->u_offs  = qrtex->rtex.u_offs;
+      r->v_offs  = qrtex->rtex.v_offs;
+      r->lu_offs = qrtex->lu_offs;
+      r->lv_offs = qrtex->lv_offs;
+      // texture ids
+      r->tid     = qrtex->tex_id;
+      r->lid     = qrtex->lmap_id;
+      r->ys      = span->ys;
+      r->ye      = span->ye;
+      r->mip     = qrtex->mip;
+      r->eoc     = 0;
+      span_ring_push();
 #ifdef DEBUG
-    unsigned int tm_ss = time();
+      tm_srfspan += time() - tm_ss;
 #endif
+      // next span
+      ispan = span->next;
+    }
+  }
+  // clear spans for this column
+  span_heads_0[c] = 0;
+  span_heads_1[c] = 0;
+  // end of column
+  t_span_regs *r = span_ring_alloc();
+  r->eoc = empty ? 2 : 1;
+  span_ring_push();
+}
 
-    // surface_setup_span_nuv
-    int nid = rtexs[span->fid].nrm_id;
-    int sid = rtexs[span->fid].tvc_id;
-    const p3d *n = &trsf_normals[nid];
-    const p3d *u = &trsf_texvecs[sid].vecS;
-    const p3d *v = &trsf_texvecs[sid].vecT;
-    int dr = dot3( rx,ry,rz, n->x,n->y,n->z )>>8;
-    int du = dot3( rx,ry,rz, u->x,u->y,u->z )>>8;
-    int dv = dot3( rx,ry,rz, v->x,v->y,v->z )>>8;
-    // texture ids
-    int tid = rtexs[span->fid].tex_id;
-    int lid = rtexs[span->fid].lmap_id;
+// -----------------------------------------------------
 
+// Streams the span registers to the GPU, column after column (runs on core 0)
+void stream_spans()
+{
+  int c = 0;
+  while (c < SCREEN_WIDTH) {
+    // wait for core 1
+    while (span_ring_tail == span_ring_head) { }
+    memory_barrier();
 #ifdef DEBUG
     unsigned int tm_ap = time();
-    tm_srfspan += tm_ap - tm_ss;
-#endif
-
-#if 0
-    // bind the surface to the rasterizer
-    col_send(
-      PARAMETER_PLANE_A(n->y,u->y,v->y),
-      PARAMETER_PLANE_A_EX(du,dv) | PARAMETER
-    );
-    // rconvex_texturing_bind
-    col_send(
-      PARAMETER_UV_OFFSET(rtexs[span->fid].rtex.v_offs),
-      PARAMETER_UV_OFFSET_EX(rtexs[span->fid].rtex.u_offs) | PARAMETER
-    );
-    // column drawing
-    col_send(
-      COLDRAW_PLANE_B(rtexs[span->fid].rtex.ded, dr),
-      COLDRAW_COL(tid, span->ys, span->ye, 15) | PLANE
-    );
-    // light map
-    col_send(
-      PARAMETER_PLANE_A(n->y,u->y,v->y),
-      PARAMETER_PLANE_A_EX(du,dv) | PARAMETER
-    );
-    // rconvex_texturing_bind_lightmap
-    col_send(
-      PARAMETER_UV_OFFSET(rtexs[span->fid].lv_offs),
-      PARAMETER_UV_OFFSET_EX(rtexs[span->fid].lu_offs) | PARAMETER | LIGHTMAP_EN
-    );
-    // column drawing
-    col_send(
-      COLDRAW_PLANE_B(rtexs[span->fid].rtex.ded, dr),
-      COLDRAW_COL(lid, span->ys, span->ye, 15) | PLANE
-    );
-#else
-    *PARAMETER_PLANE_A_ny     = n->y;
-    *PARAMETER_PLANE_A_uy     = u->y;
-    *PARAMETER_PLANE_A_vy     = v->y;
-    *PARAMETER_PLANE_A_EX_du  = du;
-    *PARAMETER_PLANE_A_EX_dv  = dv;
-    *PARAMETER_UV_OFFSET_v    = rtexs[span->fid].rtex.v_offs;
-    *PARAMETER_UV_OFFSET_EX_u = rtexs[span->fid].rtex.u_offs;
-    *PARAMETER_UV_OFFSET_EX_lmap = 0;
-    *COLDRAW_PLANE_B_ded      = rtexs[span->fid].rtex.ded;
-    *COLDRAW_PLANE_B_dr       = dr;
-    *COLDRAW_COL_texid        = tid;
-    // *COLDRAW_COL_light   = 15;
-    *COLDRAW_COL_start        = span->ys;
-    *COLDRAW_COL_end          = span->ye;
-    //
-    *PARAMETER_PLANE_A_ny = n->y;
-    *PARAMETER_PLANE_A_uy = u->y;
-    *PARAMETER_PLANE_A_vy = v->y;
-    *PARAMETER_PLANE_A_EX_du = du;
-    *PARAMETER_PLANE_A_EX_dv = dv;
-    *PARAMETER_UV_OFFSET_v    = rtexs[span->fid].lv_offs;
-    *PARAMETER_UV_OFFSET_EX_u = rtexs[span->fid].lu_offs;
-    *PARAMETER_UV_OFFSET_EX_lmap = 1;
-    *COLDRAW_PLANE_B_ded = rtexs[span->fid].rtex.ded;
-    *COLDRAW_PLANE_B_dr  = dr;
-    *COLDRAW_COL_texid   = lid;
-    *COLDRAW_COL_start   = span->ys;
-    *COLDRAW_COL_end     = span->ye;
 #endif
+    const t_span_regs *r = span_ring + span_ring_tail;
+    if (r->eoc) {
+      // background filler
+      if (r->eoc == 2) {
+        col_send(
+          COLDRAW_WALL(Y_MAX, 0, 0),
+          COLDRAW_COL(0, 0, 239, 0) | WALL
+        );
+      }
+      // send end of column
+      col_send(0, COLDRAW_EOC);
+      ++c;
+    } else {
+      int mip = r->mip; // smaller mip levels see the texture coordinates shrink
+      *PARAMETER_PLANE_A_ny     = r->ny;
+      *PARAMETER_PLANE_A_uy     = r->uy >> mip;
+      *PARAMETER_PLANE_A_vy     = r->vy >> mip;
+      *PARAMETER_PLANE_A_EX_du  = r->du >> mip;
+      *PARAMETER_PLANE_A_EX_dv  = r->dv >> mip;
+      *PARAMETER_UV_OFFSET_v    = r->v_offs >> mip;
+      *PARAMETER_UV_OFFSET_EX_u = r->u_offs >> mip;
+      *PARAMETER_UV_OFFSET_EX_lmap = 0;
+      *COLDRAW_PLANE_B_ded      = r->ded;
+      *COLDRAW_PLANE_B_dr       = r->dr;
+      *COLDRAW_COL_texid        = r->tid;
+      // *COLDRAW_COL_light   = 15;
+      *COLDRAW_COL_start        = r->ys;
+      *COLDRAW_COL_end          = r->ye;
+      //
+      *PARAMETER_PLANE_A_ny = r->ny;
+      *PARAMETER_PLANE_A_uy = r->uy;
+      *PARAMETER_PLANE_A_vy = r->vy;
+      *PARAMETER_PLANE_A_EX_du = r->du;
+      *PARAMETER_PLANE_A_EX_dv = r->dv;
+      *PARAMETER_UV_OFFSET_v    = r->lv_offs;
+      *PARAMETER_UV_OFFSET_EX_u = r->lu_offs;
+      *PARAMETER_UV_OFFSET_EX_lmap = 1;
+      *COLDRAW_PLANE_B_ded = r->ded;
+      *COLDRAW_PLANE_B_dr  = r->dr;
+      *COLDRAW_COL_texid   = r->lid;
+      *COLDRAW_COL_start   = r->ys;
+      *COLDRAW_COL_end     = r->ye;
+    }
+    // release the slot
+    memory_barrier();
+    span_ring_tail = (span_ring_tail + 1) & (SPAN_RING_SIZE-1);
     // process pending column commands
 #ifdef DEBUG
     unsigned int tm_cp = time();
@@ -337,17 +500,15 @@ void render_spans(int c, int ispan)
 #ifdef DEBUG
     tm_colprocess += time() - tm_cp;
 #endif
-    // next span
-    ispan = span->next;
   }
-
 }
 
 // -----------------------------------------------------
 
 volatile int vfc_len;
 
-void renderLeaf(int core,const unsigned char *ptr);
+void renderLeaf(int core,const unsigned char *ptr,const unsigned char *mask);
+void renderLeavesWorker(int core);
 void frustumTest(int first,int last);
 
 volatile int core1_todo;
@@ -366,13 +527,19 @@ void main_1()
     core1_todo = 0;
     switch (todo) {
       case 1:
-        // render the other leaf
-        renderLeaf(1,(const unsigned char*)memchunk);
+        // claim and render leaves alongside core 0
+        renderLeavesWorker(1);
         break;
       case 2:
         // frustum vis on other half
         frustumTest((vfc_len>>1)+1,vfc_len-1);
         break;
+      case 3:
+        // compute span registers, core 0 streams them
+        for (int c = 0; c < SCREEN_WIDTH; ++c) {
+          produce_spans(c);
+        }
+        break;
     }
     // sync
     core1_done = 1;
@@ -397,9 +564,9 @@ unsigned short locate_leaf()
     }
     // get node and plane
     // uses intermediate buffers since length of read has to be multiple of 4
-    spiflash_copy(o_bsp_nodes + nid * sizeof(t_my_node), buf20, sizeof(buf20));
+    spiflash_copy(mfst.o_bsp_nodes + nid * sizeof(t_my_node), buf20, sizeof(buf20));
     volatile const t_my_node *nd  = (volatile const t_my_node *)buf20;
-    spiflash_copy(o_bsp_planes + nd->plane_id * sizeof(t_my_plane), buf12, sizeof(buf12));
+    spiflash_copy(mfst.o_bsp_planes + nd->plane_id * sizeof(t_my_plane), buf12, sizeof(buf12));
     volatile const t_my_plane *pl = (volatile const t_my_plane *)buf12;
     // compute side
     int side = (dot3(view.x,view.y,view.z, pl->nx,pl->ny,pl->nz)>>8) - (pl->dist);
@@ -416,28 +583,68 @@ unsigned short locate_leaf()
 
 // -----------------------------------------------------
 
-static inline int leafOffset(int leaf)
+// leaf offsets table: offset and size of each leaf, leaves are stored
+// in an order that keeps co-visible leaves close in flash
+// (tables are o_leaf_offsets by leaf id, o_vis_offsets by vislist entry)
+static inline int leafOffset(int table,int leaf)
 {
   volatile int offset;
-  spiflash_copy(o_leaf_offsets + leaf*sizeof(int), &offset, sizeof(int));
+  spiflash_copy(table + leaf*sizeof(int)*2, &offset, sizeof(int));
   return offset;
 }
 
 // -----------------------------------------------------
 
+// Face masks (qrepack -face-vis): which faces of the leaves in the vislist
+// may be seen from anywhere in the view leaf. The block of a leaf starts
+// with the offset of the mask of each vislist entry, or FACE_MASK_ALL if
+// all faces may be visible, FACE_MASK_NONE if none is (the leaf is not
+// even read). Bit f of a mask is face f of the leaf record.
+#define FACE_MASK_NONE 0
+#define FACE_MASK_ALL  0xffff
+
+void readFaceMasks(int leaf)
+{
+  if (leaf == face_masks_leaf) {
+    return; // same view leaf, masks already there
+  }
+  volatile int range[2]; // start, length
+  spiflash_copy(mfst.o_face_masks + leaf*sizeof(int)*2, range, sizeof(int)*2);
+  if (range[1] < 0 || range[1] > mfst.n_max_mask_bytes) {
+    face_masks_leaf = -1;
+    return; // flash is being rewritten, see check_pack
+  }
+  spiflash_copy(range[0], (volatile int*)face_masks, range[1] + 4/*last bytes*/);
+  face_masks_leaf = leaf;
+}
+
+// mask offset of the vislist entry in position pos
+static inline int faceMaskOffset(int pos)
+{
+  if (face_masks_leaf < 0) {
+    return FACE_MASK_ALL;
+  }
+  return ((const unsigned short *)face_masks)[pos];
+}
+
+// -----------------------------------------------------
+
 int readLeafVisList(int leaf)
 {
-  int offset = leafOffset(leaf);
+  int offset = leafOffset(mfst.o_leaf_offsets,leaf);
   volatile int start;
   spiflash_copy(offset + 6 * sizeof(short), &start, sizeof(int));
   volatile int len;
   spiflash_copy(offset + 6 * sizeof(short) + sizeof(int), &len, sizeof(int));
+  if (len < 0 || len > mfst.n_max_vislen) {
+    return 0; // flash is being rewritten, see check_pack
+  }
   // read the entire list in local memory
-  spiflash_copy(o_vislist + start * sizeof(short), (volatile int*)vislist, len * sizeof(short) + 4/*ensures we don't miss last bytes if non x4*/);
+  spiflash_copy(mfst.o_vislist + start * sizeof(short), (volatile int*)vislist, len * sizeof(short) + 4/*ensures we don't miss last bytes if non x4*/);
   // now read all bboxes
   volatile unsigned char *dst = (unsigned char *)memchunk;
   for (int i = 0; i < len; ++i) {
-    spiflash_copy(leafOffset(vislist[i]), (volatile int *)dst, sizeof(short)*6 );
+    spiflash_copy(leafOffset(mfst.o_vis_offsets,vislist[i]), (volatile int *)dst, sizeof(short)*6 );
     dst += sizeof(short) * 6;
   }
   return len;
@@ -445,6 +652,76 @@ int readLeafVisList(int leaf)
 
 // -----------------------------------------------------
 
+#ifdef DEBUG
+unsigned int tm_vis_tests; // time spent reading and testing bboxes
+unsigned int num_vis_bytes;
+#endif
+
+// Reads the run-length vislist of a leaf, as produced by qrepack -vis-rle,
+// and tests each leaf against the frustum while decoding: only the visible
+// leaves are stored in vislist (no bbox array, no core 1 pass).
+// A non zero byte holds 8 bits, a zero byte is followed by the number of
+// zero bytes it stands for. Bit r is set if the leaf stored in r-th
+// position in flash is visible, entries index o_vis_offsets.
+int readLeafVisListRLE(int leaf)
+{
+  int offset = leafOffset(mfst.o_leaf_offsets,leaf);
+  volatile int start_len[2];
+  spiflash_copy(offset + 6 * sizeof(short), start_len, 2*sizeof(int));
+  int len = start_len[1];
+  if (len < 0 || len > mfst.n_max_vis_bytes) {
+    return 0; // flash is being rewritten, see check_pack
+  }
+  spiflash_copy(mfst.o_vislist + start_len[0], (volatile int*)vis_rle, len + 4/*last bytes*/);
+#ifdef DEBUG
+  num_vis_bytes = len;
+#endif
+  volatile int bx[3];
+  int num = 0;
+  int r   = 0;
+  int pos = 0; // position of the entry, see faceMaskOffset
+  const unsigned char *ptr = vis_rle;
+  const unsigned char *end = vis_rle + len;
+  while (ptr < end) {
+    int b = *ptr++;
+    if (b == 0) {
+      r += (*ptr++) << 3; // run of zero bytes
+      continue;
+    }
+    int rb = r;
+    while (b) {
+      if (b & 1) {
+        if (faceMaskOffset(pos) == FACE_MASK_NONE) {
+#ifdef DEBUG
+          ++num_masked_leaves;
+#endif
+        } else {
+#ifdef DEBUG
+          unsigned int tm_t = time();
+#endif
+          spiflash_copy(leafOffset(mfst.o_vis_offsets,rb), bx, sizeof(short)*6 );
+          if (frustum_aabb_overlap((const aabb *)bx, &frustum_trsf) && num < mfst.n_max_vislen) {
+            if (mfst.flags & MAP_FLAG_FACES) {
+              vis_pos[num] = pos;
+            }
+            vislist[num++] = rb;
+          }
+#ifdef DEBUG
+          tm_vis_tests += time() - tm_t;
+#endif
+        }
+        ++pos;
+      }
+      b >>= 1;
+      ++rb;
+    }
+    r += 8;
+  }
+  return num;
+}
+
+// -----------------------------------------------------
+
 void frustumTest(int first,int last)
 {
   int num_culled  = 0;
@@ -465,9 +742,17 @@ void frustumTest(int first,int last)
 
 void getLeaf(int leaf,volatile int **p_dst)
 {
-  int offset = leafOffset(leaf) + sizeof(short) * 6 + sizeof(int) * 2;
-  //                            ^^^ bbox            ^^^ vis start,len
-  int length = leafOffset(leaf + 1) - offset;
+  volatile int range[2]; // offset, size
+  spiflash_copy(mfst.o_vis_offsets + leaf*sizeof(int)*2, range, sizeof(int)*2);
+  int offset = range[0] + sizeof(short) * 6 + sizeof(int) * 2;
+  //                    ^^^ bbox            ^^^ vis start,len
+  int length = range[0] + range[1] - offset;
+  if (length < 0 || length > mfst.n_max_leaf_size) {
+    // flash is being rewritten (see check_pack), renderLeaf rejects the header
+    (*p_dst)[0] = 0;
+    *p_dst += 1;
+    return;
+  }
   if (length & 3) { // ensures we get the last bytes
     length += 4;
   }
@@ -480,44 +765,234 @@ void getLeaf(int leaf,volatile int **p_dst)
 p3d trsf_vertices[POLY_MAX_SZ];
 p3d face_vertices[POLY_MAX_SZ];
 p2d face_prj_vertices[POLY_MAX_SZ];
+int face_idx_0[POLY_MAX_SZ]; // decoded indices of the current face, core 0
+int face_idx_1[POLY_MAX_SZ]; // decoded indices of the current face, core 1
+
+#define LEAF_FLAG_IDX16 1 // leaf indices are uint16 (uint8 otherwise)
+#define LEAF_FLAG_VTX8  2 // leaf vertices are 3 x 8 bits deltas to a base
+#define LEAF_FLAG_VTX10 4 // leaf vertices are 3 x 10 bits deltas to a base
+#define LEAF_FLAG_GIDS  8 // leaf vertices are followed by their global ids
+
+#define PRJ_PENDING 0x7FFE // vertex not yet projected
+#define PRJ_CLIPPED 0x7FFF // vertex behind the near plane
+
+// Transformed vertex cache: with global vertex ids (LEAF_FLAG_GIDS), a
+// vertex shared by neighbouring leaves is transformed and projected once
+// per frame. Direct mapped on the low bits of the id (ids follow the leaf
+// order), one cache per core so that a slot is only written by its core.
+// Slots are stamped with the frame they were filled in. The caches are
+// taken from the arena, only for maps with MAP_FLAG_GIDS.
+#define VTX_CACHE_SIZE 128 // per core, power of two
 
-void renderLeaf(int core,const unsigned char *ptr)
+typedef struct {
+  unsigned short gid;
+  unsigned short stamp;
+  p3d            v; // view space
+  p2d            p; // projected, or PRJ_CLIPPED
+} t_vtx_slot;
+
+t_vtx_slot    *vtx_cache; // 2 x VTX_CACHE_SIZE (core 0, then core 1), 0 if none
+unsigned short vtx_stamp; // stamp of the current frame, never 0
+
+// clears the stamps, no slot is valid afterwards
+static inline void vtx_cache_clear()
 {
-  if (ptr == 0) {
-    return;
+  if (vtx_cache) {
+    for (int i = 0; i < 2 * VTX_CACHE_SIZE; ++i) {
+      vtx_cache[i].stamp = 0;
+    }
   }
-  // select temporary table
-  p2d *prj_vertices;
-  if (core == 0) { prj_vertices = prj_vertices_0;
-  } else         { prj_vertices = prj_vertices_1; }
-  // num vertices
-  int numv = *(const int*)ptr;
-  ptr += sizeof(int);
-  // project vertices
-  const p3d *vertices = (const p3d *)ptr;
-  ptr += numv * sizeof(p3d);
-  for (int v = 0; v < numv; ++v) {
-    p3d p = vertices[v];
+}
+
+// vertex stream of the current leaf
+typedef struct {
+  const unsigned char  *data;
+  int                   enc;   // 0 (absolute shorts) or LEAF_FLAG_VTX8/10
+  int                   shift; // delta scale
+  p3d                   base;
+  const unsigned short *gids;  // global ids, 0 if none
+  t_vtx_slot           *cache; // cache of the core
+} t_leaf_vertices;
+
+// decodes a leaf vertex
+static inline p3d leaf_vertex(const t_leaf_vertices *lv,int v)
+{
+  p3d p;
+  if (lv->enc == LEAF_FLAG_VTX8) {
+    const unsigned char *d = lv->data + v * 3;
+    p.x = lv->base.x + (d[0] << lv->shift);
+    p.y = lv->base.y + (d[1] << lv->shift);
+    p.z = lv->base.z + (d[2] << lv->shift);
+  } else if (lv->enc == LEAF_FLAG_VTX10) {
+    unsigned int w = ((const unsigned int *)lv->data)[v];
+    p.x = lv->base.x + (( w        & 1023) << lv->shift);
+    p.y = lv->base.y + (((w >> 10) & 1023) << lv->shift);
+    p.z = lv->base.z + (((w >> 20) & 1023) << lv->shift);
+  } else {
+    p = ((const p3d *)lv->data)[v];
+  }
+  return p;
+}
+
+// cache slot of a leaf vertex, transformed and projected unless already
+// done this frame
+static inline const t_vtx_slot *vtx_slot(const t_leaf_vertices *lv,int v)
+{
+  int         gid = lv->gids[v];
+  t_vtx_slot *s   = lv->cache + (gid & (VTX_CACHE_SIZE-1));
+  if (s->stamp != vtx_stamp || s->gid != gid) {
+#ifdef DEBUG
+    ++num_vtx_transforms;
+#endif
+    p3d p = leaf_vertex(lv, v);
+    transform(&p.x, &p.y, &p.z, 1);
+    s->gid   = gid;
+    s->stamp = vtx_stamp;
+    s->v     = p;
+    if (p.z >= z_clip) {
+      project(&p, &s->p);
+    } else {
+      s->p.x = PRJ_CLIPPED;
+    }
+  }
+  return s;
+}
+
+// leaf vertex in view space
+static inline p3d view_vertex(const t_leaf_vertices *lv,int v)
+{
+  if (lv->gids) {
+    return vtx_slot(lv, v)->v;
+  }
+#ifdef DEBUG
+  ++num_vtx_transforms;
+#endif
+  p3d p = leaf_vertex(lv, v);
+  transform(&p.x, &p.y, &p.z, 1);
+  return p;
+}
+
+// decodes, transforms and projects a leaf vertex on first use only,
+// vertices only referenced by rejected faces are never touched
+static inline p2d prj_vertex(p2d *prj_vertices,const t_leaf_vertices *lv,int v)
+{
+  if (prj_vertices[v].x == PRJ_PENDING) {
+    if (lv->gids) {
+      prj_vertices[v] = vtx_slot(lv, v)->p;
+      return prj_vertices[v];
+    }
+#ifdef DEBUG
+    ++num_vtx_transforms;
+#endif
+    p3d p = leaf_vertex(lv, v);
     transform(&p.x, &p.y, &p.z, 1);
     if (p.z >= z_clip) {
       // project
       project(&p, &prj_vertices[v]);
     } else {
       // tag as clipped
-      prj_vertices[v].x = 0x7FFF;
+      prj_vertices[v].x = PRJ_CLIPPED;
     }
   }
-  // rasterize faces
+  return prj_vertices[v];
+}
+
+// renders a leaf, mask selects the faces to consider (all if null)
+void renderLeaf(int core,const unsigned char *ptr,const unsigned char *mask)
+{
+  if (ptr == 0) {
+    return;
+  }
+  // select temporary tables
+  p2d *prj_vertices;
+  int *face_idx;
+  if (core == 0) { prj_vertices = prj_vertices_0; face_idx = face_idx_0;
+  } else         { prj_vertices = prj_vertices_1; face_idx = face_idx_1; }
+  // leaf header
+  const unsigned short *hdr = (const unsigned short *)ptr;
+  ptr += 4 * sizeof(short);
+  if ((hdr[0] & 255) != LEAF_FORMAT) {
+    return; // not expected, load_map rejects packs of other versions
+  }
+  int flags = hdr[0] >> 8;
+  int wide  = flags & LEAF_FLAG_IDX16;
+  // num vertices
+  int numv = hdr[1];
   // num faces
-  int numf = *(const int*)ptr;
-  ptr += sizeof(int);
-  const unsigned short *faces = (const unsigned short *)ptr;
-  ptr += numf * sizeof(short) * 10; // 10 shorts per face
-  // face indices
-  const int *indices = (const int*)ptr;
+  int numf = hdr[2];
+  // vertices, decoded and projected lazily
+  t_leaf_vertices lv;
+  lv.enc   = flags & (LEAF_FLAG_VTX8 | LEAF_FLAG_VTX10);
+  lv.shift = hdr[3];
+  int vtx_bytes;
+  if (lv.enc == 0) {
+    vtx_bytes = numv * sizeof(p3d);
+  } else {
+    const short *vhdr = (const short *)ptr;
+    lv.base.x = vhdr[0];
+    lv.base.y = vhdr[1];
+    lv.base.z = vhdr[2];
+    ptr += 4 * sizeof(short);
+    vtx_bytes = numv * (lv.enc == LEAF_FLAG_VTX8 ? 3 : 4);
+  }
+  lv.data = ptr;
+  ptr += (vtx_bytes + 3) & (~3); // padded to 4
+  lv.gids  = 0;
+  lv.cache = 0;
+  if (flags & LEAF_FLAG_GIDS) {
+    if (vtx_cache) { // none with packs predating MAP_FLAG_GIDS
+      lv.gids  = (const unsigned short *)ptr;
+      lv.cache = vtx_cache + core * VTX_CACHE_SIZE;
+    }
+    ptr += (numv * sizeof(short) + 3) & (~3); // padded to 4
+  }
+  for (int v = 0; v < numv; ++v) {
+    prj_vertices[v].x = PRJ_PENDING;
+  }
+  // rasterize faces
+  const int *faces = (const int *)ptr;
+  ptr += numf * sizeof(int) * 5; // 5 ints per face
+  // face indices, uint8 or uint16, one face after the other
+  const unsigned char *indices = ptr;
   // go through faces
-  const unsigned short *fptr = faces;
+  const int *fptr = faces;
   for (int f = 0; f < numf; ++f) {
+    int            plane_d   = fptr[0];
+    unsigned int   w         = (unsigned int)fptr[1];
+    unsigned short nrm_id    = w & 65535;
+    unsigned short tvc_id    = w >> 16;
+    w                        = (unsigned int)fptr[2];
+    unsigned short tex_id    = w & 1023;
+    unsigned short lmap_id   = (w >> 10) & 1023;
+    unsigned short num_idx   = w >> 20;
+    w                        = (unsigned int)fptr[3];
+    unsigned short lmap_uv   = w & 65535;
+    p3d            lmap_pref;
+    lmap_pref.x              = (short)(w >> 16);
+    w                        = (unsigned int)fptr[4];
+    lmap_pref.y              = (short)(w & 65535);
+    lmap_pref.z              = (short)(w >> 16);
+    fptr += 5;
+    const unsigned char *face_indices_ptr = indices;
+    indices += num_idx << wide;
+    // not visible from the view leaf? => skip
+    if (mask && !(mask[f >> 3] & (1 << (f & 7)))) {
+#ifdef DEBUG
+      ++num_masked_faces;
+#endif
+      continue;
+    }
+    // backface? => skip, before touching any vertex
+    if (((plane_d - view_dots[nrm_id]) >> 8) < 0) {
+#ifdef DEBUG
+      ++num_backfaces;
+#endif
+      continue;
+    }
+    if (num_idx > POLY_MAX_SZ) {
+      printf("#P\n");
+      continue;
+    }
     int fc;
     if (core == 0) {
       fc = rface_next_id_0++;
@@ -528,25 +1003,16 @@ void renderLeaf(int core,const unsigned char *ptr)
       printf("#F\n");
       return;
     }
-    unsigned short first_idx = *(fptr++);
-    unsigned short num_idx   = *(fptr++);
-    unsigned short nrm_id    = *(fptr++);
-    unsigned short tvc_id    = *(fptr++);
-    unsigned short tex_id    = *(fptr++);
-    unsigned short lmap_id   = *(fptr++);
-    unsigned short lmap_uv   = *(fptr++);
-    p3d            lmap_pref;
-    lmap_pref.x              = *(fptr++);
-    lmap_pref.y              = *(fptr++);
-    lmap_pref.z              = *(fptr++);
-    // check vertices for clipping
-    const int *idx = indices + first_idx;
+    // decode indices and check vertices for clipping
     int n_clipped  = 0;
     int max_x      = -2147483647; int max_y = -2147483647;
     int min_x      = 2147483647;  int min_y = 2147483647;
     for (int v = 0; v < num_idx; ++v) {
-      p2d p = prj_vertices[*(idx++)];
-      if (p.x == 0x7FFF) {
+      int i = wide ? ((const unsigned short *)face_indices_ptr)[v]
+                   : face_indices_ptr[v];
+      face_idx[v] = i;
+      p2d p = prj_vertex(prj_vertices, &lv, i);
+      if (p.x == PRJ_CLIPPED) {
         ++n_clipped;
       } else {
         if (p.x > max_x) { max_x = p.x; }
@@ -568,6 +1034,7 @@ void renderLeaf(int core,const unsigned char *ptr)
       continue;
     }
     // prepare texturing info
+    p3d p_ref = leaf_vertex(&lv, face_idx[0]);
     char upos = lmap_uv & 255;
     char vpos = lmap_uv >> 8;
     // p3d o = {0,0,0};
@@ -578,7 +1045,7 @@ void renderLeaf(int core,const unsigned char *ptr)
       ((int)upos) << 6, ((int)vpos) << 6,
       transform,
       &lmap_pref,
-      vertices + indices[first_idx],
+      &p_ref,
       &rtexs[fc]);
     // backface? => skip
     if (rtexs[fc].rtex.ded < 0) {
@@ -589,14 +1056,19 @@ void renderLeaf(int core,const unsigned char *ptr)
     // surface and texture info
     rtexs[fc].nrm_id  = nrm_id;
     rtexs[fc].tvc_id  = tvc_id;
-    rtexs[fc].tex_id  = tex_id;
+    int mip = faceMip(rtexs[fc].rtex.ded);
+    rtexs[fc].tex_id  = tex_id + mip;
     rtexs[fc].lmap_id = lmap_id;
+    rtexs[fc].mip     = mip;
+#ifdef DEBUG
+    ++num_mip_faces[mip];
+#endif
     // clip?
     const int *ptr_indices;
     const p2d *ptr_prj_vertices;
     if (n_clipped == 0) {
       // no clipping required
-      ptr_indices = indices + first_idx;
+      ptr_indices = face_idx;
       ptr_prj_vertices = prj_vertices;
     } else {
 #ifdef DEBUG
@@ -604,12 +1076,10 @@ void renderLeaf(int core,const unsigned char *ptr)
 #endif
       // clip the face
       // -> transform vertices
-      const int *idx = indices + first_idx;
+      const int *idx = face_idx;
       p3d *v_dst = trsf_vertices;
       for (int v = 0; v < num_idx; ++v) {
-        p3d p = vertices[*(idx++)];
-        transform(&p.x, &p.y, &p.z, 1);
-        *(v_dst++) = p;
+        *(v_dst++) = view_vertex(&lv, *(idx++));
       }
       // -> clip
       int n_clipped = 0;
@@ -704,40 +1174,200 @@ void renderLeaf(int core,const unsigned char *ptr)
 }
 
 // -----------------------------------------------------
+// Leaf work queue, shared by both cores
+// -----------------------------------------------------
+
+// Peterson lock, the cores share memory without atomics
+volatile int lock_want[2];
+volatile int lock_turn;
 
-void renderLeaves(int len)
+static inline void lock(int core)
 {
-  int next = 0;
-  while (next < len) {
-    volatile int *dst = memchunk;
-    // read a first leaf
-    int *first = 0;
-    while (next < len) {
-      if (vislist[next] < 65535) {
-        first = (int*)dst;
-        getLeaf(vislist[next], &dst);
-        break;
-      }
-      ++next;
-    }
-    ++next;
-    // read a second leaf
-    int *second = 0;
-    while (next < len) {
-      if (vislist[next] < 65535) {
-        second = (int*)dst;
-        getLeaf(vislist[next], &dst);
-        break;
+  lock_want[core] = 1;
+  lock_turn       = 1 - core;
+  while (lock_want[1 - core] && lock_turn == 1 - core) { }
+}
+
+static inline void unlock(int core)
+{
+  lock_want[core] = 0;
+}
+
+volatile int leaf_next; // next vislist entry to be claimed
+
+#ifdef DEBUG
+unsigned int tm_busy[2]; // per-core time spent rendering leaves
+unsigned int tm_idle[2]; // per-core time spent waiting (lock, barrier)
+#endif
+
+// Claims the next frustum visible leaf and loads it in the core half of
+// memchunk, sets its face mask. Returns 0 once the vislist is exhausted.
+// NOTE: flash bursts stall both cores anyway, so loading under the lock
+//       costs nothing while keeping spiflash accesses exclusive
+const unsigned char *claimLeaf(int core,const unsigned char **mask)
+{
+  volatile int *dst = memchunk + core * memchunk_half;
+  const unsigned char *leaf = 0;
+#ifdef DEBUG
+  unsigned int tm_lk = time();
+#endif
+  lock(core);
+#ifdef DEBUG
+  tm_idle[core] += time() - tm_lk;
+#endif
+  while (leaf_next < vfc_len) {
+    int i = leaf_next++;
+    int l = vislist[i];
+    if (l < 65535) { // skip leaves tagged by frustumTest
+      int m = faceMaskOffset((mfst.flags & MAP_FLAG_VIS_RLE) ? vis_pos[i] : i);
+      if (m == FACE_MASK_NONE) {
+#ifdef DEBUG
+        ++num_masked_leaves;
+#endif
+        continue; // no face visible from the view leaf
       }
-      ++next;
+      *mask = m == FACE_MASK_ALL ? 0 : face_masks + m;
+      leaf  = (const unsigned char *)dst;
+      getLeaf(l, &dst);
+      break;
     }
-    ++next;
-    // render leaves
-    if (first) {
-      core1_done = 0;
-      core1_todo = 1; // request core 1 assistance
-      renderLeaf(0,(const unsigned char*)second);
-      while (core1_done != 1) {} // wait for core 1
+  }
+  unlock(core);
+  return leaf;
+}
+
+// Renders leaves until the vislist is exhausted (runs on both cores)
+void renderLeavesWorker(int core)
+{
+  while (1) {
+    const unsigned char *mask;
+    const unsigned char *leaf = claimLeaf(core, &mask);
+    if (leaf == 0) {
+      break;
+    }
+#ifdef DEBUG
+    unsigned int tm_rl = time();
+#endif
+    renderLeaf(core, leaf, mask);
+#ifdef DEBUG
+    tm_busy[core] += time() - tm_rl;
+#endif
+  }
+}
+
+// -----------------------------------------------------
+
+void renderLeaves()
+{
+  leaf_next  = 0;
+  core1_done = 0;
+  core1_todo = 1; // request core 1 assistance
+  renderLeavesWorker(0);
+#ifdef DEBUG
+  unsigned int tm_wt = time();
+#endif
+  while (core1_done != 1) {} // wait for core 1, only barrier of the pass
+#ifdef DEBUG
+  tm_idle[0] += time() - tm_wt;
+#endif
+}
+
+// -----------------------------------------------------
+// Map loading
+// -----------------------------------------------------
+
+#define ALIGN4(b) (((b)+3)&~3)
+
+// takes bytes from the arena, sets ptr when apply is set
+#define ARENA_TAKE(ptr,type,bytes) { if (apply) { ptr = (type)p; } p += ALIGN4(bytes)>>2; }
+
+// arena layout of a map, returns the number of bytes used
+int arena_layout(const t_map_manifest *m,int apply)
+{
+  int *p    = arena;
+  int  half = 4 + (m->n_max_leaf_size >> 2);                 // ints, one leaf per core
+  int  rle  = m->flags & MAP_FLAG_VIS_RLE;
+  int  fcs  = m->flags & MAP_FLAG_FACES;
+  int  gids = m->flags & MAP_FLAG_GIDS;
+  int  bbox = rle ? 0 : ALIGN4(m->n_max_vislen * sizeof(aabb)) >> 2; // ints, see readLeafVisList
+  ARENA_TAKE(normals,        p3d*,            m->n_normals * sizeof(p3d));
+  ARENA_TAKE(trsf_normals,   p3d*,            m->n_normals * sizeof(p3d));
+  ARENA_TAKE(view_dots,      int*,            m->n_normals * sizeof(int));
+  ARENA_TAKE(texvecs,        t_texvecs*,      m->n_texvecs * sizeof(t_texvecs));
+  ARENA_TAKE(trsf_texvecs,   t_texvecs*,      m->n_texvecs * sizeof(t_texvecs));
+  ARENA_TAKE(prj_vertices_0, p2d*,            m->n_max_verts * sizeof(p2d));
+  ARENA_TAKE(prj_vertices_1, p2d*,            m->n_max_verts * sizeof(p2d));
+  ARENA_TAKE(vislist,        unsigned short*, m->n_max_vislen * sizeof(short) + 4);
+  //                                                        last bytes ^^^
+  ARENA_TAKE(vis_rle,        unsigned char*,  rle ? m->n_max_vis_bytes + 4 : 0);
+  ARENA_TAKE(vis_pos,        unsigned short*, rle && fcs ? m->n_max_vislen * sizeof(short) : 0);
+  ARENA_TAKE(face_masks,     unsigned char*,  fcs ? m->n_max_mask_bytes + 4 : 0);
+  ARENA_TAKE(vtx_cache,      t_vtx_slot*,     gids ? 2 * VTX_CACHE_SIZE * sizeof(t_vtx_slot) : 0);
+  ARENA_TAKE(memchunk,       int*,            (half << 1 > bbox ? half << 1 : bbox) * sizeof(int));
+  if (apply) {
+    memchunk_half = half;
+  }
+  return (int)(p - arena) * sizeof(int);
+}
+
+// reads the pack manifest, returns 0 if there is no valid pack
+int read_pack(t_pack_manifest *pm)
+{
+  volatile int loc;
+  spiflash_copy(PACK_LOCATOR, &loc, sizeof(int));
+  spiflash_copy(loc & 0xffffff, (volatile int*)pm, sizeof(t_pack_manifest));
+  if (pm->magic != PACK_MAGIC || pm->version != PACK_VERSION
+   || pm->num_maps < 1 || pm->num_maps > MAX_MAPS) {
+    return 0;
+  }
+  spiflash_copy((loc & 0xffffff) + sizeof(t_pack_manifest), map_addrs, pm->num_maps * sizeof(int));
+  return 1;
+}
+
+// loads map m of the pack: manifest, then arena buffers
+// NOTE: reads flash, only when the GPU is done drawing (and core 1 idle)
+int load_map(int m)
+{
+  t_map_manifest nm;
+  spiflash_copy(map_addrs[m], (volatile int*)&nm, sizeof(t_map_manifest));
+  if (nm.leaf_format != LEAF_FORMAT) {
+    printf("#V\n"); // pack was produced by another version of qrepack
+    return 0;
+  }
+  if (arena_layout(&nm,0) > ARENA_SIZE) {
+    printf("#A %d\n",arena_layout(&nm,0)); // map too large for the arena
+    return 0;
+  }
+  mfst = nm;
+  arena_layout(&mfst,1);
+  int addr = map_addrs[m] + sizeof(t_map_manifest);
+  spiflash_copy(addr, (volatile int*)normals, ALIGN4(mfst.n_normals * sizeof(p3d)));
+  addr += ALIGN4(mfst.n_normals * sizeof(p3d));
+  spiflash_copy(addr, (volatile int*)texvecs, mfst.n_texvecs * sizeof(t_texvecs));
+  // start view
+  view        = mfst.view;
+  v_angle_y   = 0;
+  v_angle_x   = 0;
+  map_current = m;
+  face_masks_leaf = -1;
+  // vertex caches, the arena holds leftovers of the previous map
+  if (!(mfst.flags & MAP_FLAG_GIDS)) {
+    vtx_cache = 0;
+  }
+  vtx_cache_clear();
+  return 1;
+}
+
+// reloads the pack if it was rewritten while running (hot swap)
+void check_pack()
+{
+  t_pack_manifest pm;
+  if (!read_pack(&pm)) {
+    return; // being rewritten, check again later
+  }
+  if (pm.stamp != pack_mfst.stamp) {
+    if (load_map(map_current < pm.num_maps ? map_current : 0)) {
+      pack_mfst = pm;
     }
   }
 }
@@ -760,21 +1390,32 @@ static inline void render_frame()
   wait_all_drawn();
   // ---- now can access texture memory
 
+  // ---- map changes, between frames as they read flash
+  if (map_request >= 0) {
+    load_map(map_request);
+    map_request = -1;
+  } else if ((frame & 63) == 0) {
+    check_pack();
+  }
+
 #ifdef DEBUG
   unsigned int tm_0 = time();
   num_clipped = 0;
+  num_backfaces = 0;
+  for (int m = 0; m < NUM_MIPS; ++m) { num_mip_faces[m] = 0; }
 #endif
 
   /// transform frustum in world space
   //*LEDS = 1;
   frustum_transform(&frustum_view, z_clip, inv_transform, unproject, &frustum_trsf);
   /// transform normals
-  for (int n = 0; n < n_normals; ++n) {
+  for (int n = 0; n < mfst.n_normals; ++n) {
     trsf_normals[n] = normals[n];
     transform(&trsf_normals[n].x,&trsf_normals[n].y,&trsf_normals[n].z,0);
+    view_dots[n] = dot3(view.x,view.y,view.z, normals[n].x,normals[n].y,normals[n].z);
   }
   /// transform texvecs
-  for (int n = 0; n < n_texvecs; ++n) {
+  for (int n = 0; n < mfst.n_texvecs; ++n) {
     trsf_texvecs[n] = texvecs[n];
     transform(&trsf_texvecs[n].vecS.x,
               &trsf_texvecs[n].vecS.y,
@@ -794,22 +1435,49 @@ static inline void render_frame()
   unsigned int tm_2 = time();
 #endif
   //*LEDS = 3;
-  vfc_len = readLeafVisList(leaf);
+  int vis_rle_map = mfst.flags & MAP_FLAG_VIS_RLE;
+#ifdef DEBUG
+  tm_vis_tests = 0;
+  num_masked_leaves = 0;
+  num_masked_faces  = 0;
+  num_vtx_transforms = 0;
+#endif
+  if (mfst.flags & MAP_FLAG_FACES) {
+    // before the vislist, run-length decoding skips masked leaves
+    readFaceMasks(leaf);
+  }
+  if (vis_rle_map) {
+    // decoded and tested against the frustum in one pass
+    vfc_len = readLeafVisListRLE(leaf);
+  } else {
+    vfc_len = readLeafVisList(leaf);
+  }
   /// check frustum - aabb
 #ifdef DEBUG
   unsigned int tm_3 = time();
 #endif
   //*LEDS = 4;
-  core1_done = 0;
-  core1_todo = 2; // request core 1 assistance
-  frustumTest(0,vfc_len>>1);
-  while (core1_done != 1) {} // wait for core 1
+  if (!vis_rle_map) {
+    core1_done = 0;
+    core1_todo = 2; // request core 1 assistance
+    frustumTest(0,vfc_len>>1);
+    while (core1_done != 1) {} // wait for core 1
+  }
   /// render visible leaves
 #ifdef DEBUG
   unsigned int tm_4 = time();
 #endif
   //*LEDS = 5;
-  renderLeaves(vfc_len);
+#ifdef DEBUG
+  tm_busy[0] = tm_busy[1] = 0;
+  tm_idle[0] = tm_idle[1] = 0;
+#endif
+  // new stamp, invalidates the vertex caches
+  if (++vtx_stamp == 0) {
+    vtx_cache_clear();
+    vtx_stamp = 1;
+  }
+  renderLeaves();
 
 #ifdef DEBUG
   unsigned int tm_5 = time();
@@ -820,49 +1488,29 @@ static inline void render_frame()
 
   //*LEDS = 6;
   /// render the spans
-  for (int c = 0; c < SCREEN_WIDTH; ++c) {
-
-    // go through lists
-    int empty = 1;
-    for (int l = 0; l < 2; ++l) {
-      unsigned short ispan = l == 0 ? span_heads_0[c] : span_heads_1[c];
-      empty = empty & !ispan;
-      render_spans(c, ispan);
-    }
-
-    // background filler
-    if (empty) {
-      col_send(
-        COLDRAW_WALL(Y_MAX, 0, 0),
-        COLDRAW_COL(0, 0, 239, 0) | WALL
-      );
-    }
-    // send end of column
-    col_send(0, COLDRAW_EOC);
-
-    // clear spans for this column
-    span_heads_0[c] = 0;
-    span_heads_1[c] = 0;
-
-    // process pending column commands
-#ifdef DEBUG
-    unsigned int tm_cp = time();
-#endif
-    col_process();
-#ifdef DEBUG
-    tm_colprocess += time() - tm_cp;
-#endif
-
-  }
+  span_ring_head = 0;
+  span_ring_tail = 0;
+  core1_done = 0;
+  core1_todo = 3; // request core 1 assistance
+  stream_spans();
+  while (core1_done != 1) {} // wait for core 1
 
   //*LEDS = 7;
 
 #ifdef DEBUG
   unsigned int tm_6 = time();
   printf("1 %d spans\n", span_alloc_0 + (MAX_NUM_SPANS - span_alloc_1));
-  printf("2 %d rfaces (%d clipped)\n", rface_next_id_0 + (MAX_RASTER_FACES - rface_next_id_1),num_clipped);
+  printf("2 %d rfaces (%d clipped, %d backfaces)\n", rface_next_id_0 + (MAX_RASTER_FACES - rface_next_id_1),num_clipped,num_backfaces);
+  printf("2 mips %d %d %d %d\n", num_mip_faces[0], num_mip_faces[1], num_mip_faces[2], num_mip_faces[3]);
+  printf("2 masked %d leaves %d faces, %d vertex transforms\n", num_masked_leaves, num_masked_faces, num_vtx_transforms);
   printf("3 trsf %d, loc %d, vis %d, vfc %d, render %d, spans %d (cols %d, srf %d, api %d)\n",
     tm_1 - tm_0, tm_2 - tm_1, tm_3 - tm_2, tm_4 - tm_3, tm_5 - tm_4, tm_6 - tm_5, tm_colprocess, tm_srfspan, tm_api);
+  printf("4 leaves core0 busy %d idle %d, core1 busy %d idle %d\n",
+    tm_busy[0], tm_idle[0], tm_busy[1], tm_idle[1]);
+  if (vis_rle_map) {
+    printf("5 vis rle %d bytes, %d visible, decode %d, bbox tests %d\n",
+      num_vis_bytes, vfc_len, (tm_3 - tm_2) - tm_vis_tests, tm_vis_tests);
+  }
 #endif
 
 }
@@ -910,6 +1558,15 @@ void main_0()
   v_angle_y = 0;
   v_angle_x = 0;
 
+  // --------------------------
+  // load the first map
+  // --------------------------
+  map_request = -1;
+  while (!read_pack(&pack_mfst) || !load_map(0)) {
+    // no valid pack (yet), wait for one to be flashed
+    *LEDS = 2;
+  }
+
   while (1) {
 
     tm_frame = time();
@@ -921,7 +1578,12 @@ void main_0()
     int elapsed = tm - tm_frame;
     int speed = (elapsed >> 17);
 
-    prev_uart_byte = uart_byte();
+    unsigned char uart = uart_byte();
+    if ((uart & 3) == 3 && (prev_uart_byte & 3) != 3) {
+      // forward and backward together: next map in the pack
+      map_request = (map_current + 1) % pack_mfst.num_maps;
+    }
+    prev_uart_byte = uart;
     p3d front = { 0,0,256 };
     inv_transform(&front.x, &front.y, &front.z, 0);
     if (prev_uart_byte & 1) {
@@ -23,6 +23,20 @@
 
 #include "tga.h"
 #include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 using namespace LibSL;
@@ -31,11 +45,11 @@ using namespace LibSL;
 
 // --------------------------------------------------------------
 
-#define MAP "e1m1.bsp"
-v3f view_pos = v3f(480.0f, 48.0f, 88.0f); // leaf 1116 (e1m1)
+#define MAP "e1m1.bsp" // default map, when none is given on the command line
+v3f view_pos = v3f(480.0f, 48.0f, 88.0f); // leaf 1116 (e1m1), see -start
 
 // --------------------------------------------------------------
-const float scale = 4.0f; // global scale, adjusted for DMC-1
+float scale = 4.0f; // global scale, adjusted for DMC-1, see -scale
 // --------------------------------------------------------------
 
 // From [1]
@@ -196,46 +210,148 @@ typedef struct                 // Mip Texture
 } miptex_t;
 //
 
+// --------------------------------------------------------------
+// Read-only view of the BSP file, mapped in memory once. Lumps are
+// exposed as bounds-checked typed arrays, nothing is copied.
+
+template <typename T>
+class lump_view
+{
+private:
+  const T *m_ptr = nullptr;
+  size_t   m_num = 0;
+public:
+  lump_view() {}
+  lump_view(const T *ptr, size_t num) : m_ptr(ptr), m_num(num) {}
+  size_t   size()                  const { return m_num; }
+  const T& operator[](size_t i)    const { sl_assert(i < m_num); return m_ptr[i]; }
+};
+
+class bsp_view
+{
+private:
+  const uchar *m_data = nullptr;
+  size_t       m_size = 0;
+#ifdef _WIN32
+  HANDLE       m_file = INVALID_HANDLE_VALUE;
+  HANDLE       m_map  = NULL;
+#endif
+public:
+  ~bsp_view() { close(); }
+  // maps the file, returns false on failure
+  bool open(const char *fname)
+  {
+    close();
+#ifdef _WIN32
+    m_file = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+                         OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(m_file, &sz) || sz.QuadPart == 0) { close(); return false; }
+    m_map  = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_map == NULL) { close(); return false; }
+    m_data = (const uchar*)MapViewOfFile(m_map, FILE_MAP_READ, 0, 0, 0);
+    if (m_data == nullptr) { close(); return false; }
+    m_size = (size_t)sz.QuadPart;
+#else
+    int fd = ::open(fname, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { ::close(fd); return false; }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if (ptr == MAP_FAILED) return false;
+    m_data = (const uchar*)ptr;
+    m_size = (size_t)st.st_size;
+#endif
+    return true;
+  }
+  void close()
+  {
+#ifdef _WIN32
+    if (m_data != nullptr)               UnmapViewOfFile(m_data);
+    if (m_map  != NULL)                  CloseHandle(m_map);
+    if (m_file != INVALID_HANDLE_VALUE)  CloseHandle(m_file);
+    m_map  = NULL;
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_data != nullptr)               munmap((void*)m_data, m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+  }
+  size_t size() const { return m_size; }
+  // num elements of type T at offset, checked against the file size
+  template <typename T>
+  const T *at(long offset, long num = 1) const
+  {
+    sl_assert(offset >= 0 && num >= 0);
+    sl_assert((size_t)offset + sizeof(T) * (size_t)num <= m_size);
+    return (const T*)(m_data + offset);
+  }
+  // a lump as a typed array
+  template <typename T>
+  lump_view<T> lump(const dentry_t& e) const
+  {
+    return lump_view<T>(at<T>(e.offset, e.size / sizeof(T)), e.size / sizeof(T));
+  }
+};
+
 // --------------------------------------------------------------
 // Globals ( yeah, well ... just a quick tool ;) )
 
-FILE     *f = NULL; // file
+bsp_view  bsp;      // file
 dheader_t h;        // header
 
 // --------------------------------------------------------------
 
-template <typename T> long offset()            { sl_assert(false); return -1; }
-template <>           long offset<model_t>()   { return h.models.offset; }
-template <>           long offset<plane_t>()   { return h.planes.offset; }
-template <>           long offset<node_t>()    { return h.nodes.offset; }
-template <>           long offset<face_t>()    { return h.faces.offset; }
-template <>           long offset<edge_t>()    { return h.edges.offset; }
-template <>           long offset<vertex_t>()  { return h.vertices.offset; }
-template <>           long offset<dleaf_t>()   { return h.leaves.offset; }
-template <>           long offset<surface_t>() { return h.texinfo.offset; }
+template <typename T> const dentry_t& entry()            { sl_assert(false); return h.entities; }
+template <>           const dentry_t& entry<model_t>()   { return h.models; }
+template <>           const dentry_t& entry<plane_t>()   { return h.planes; }
+template <>           const dentry_t& entry<node_t>()    { return h.nodes; }
+template <>           const dentry_t& entry<face_t>()    { return h.faces; }
+template <>           const dentry_t& entry<edge_t>()    { return h.edges; }
+template <>           const dentry_t& entry<vertex_t>()  { return h.vertices; }
+template <>           const dentry_t& entry<dleaf_t>()   { return h.leaves; }
+template <>           const dentry_t& entry<surface_t>() { return h.texinfo; }
+
+template <typename T> long offset() { return entry<T>().offset; }
+
+template <typename T> lump_view<T> lump() { return bsp.lump<T>(entry<T>()); }
 
 template <typename T>
 void read(int i,T *m)
 {
-  fseek(f, offset<T>() + sizeof(T) * i, SEEK_SET);
-  fread(m, sizeof(T), 1, f);
+  *m = lump<T>()[i];
 }
 
 short readLEdge(int pos)
 {
-  fseek(f, h.ledges.offset + 2 * sizeof(short) * pos, SEEK_SET);
-  //                        ^^^ why?
-  short s;
-  fread(&s, sizeof(short), 1, f);
-  return s;
+  // list of edges entries are 32 bits, we only use the low 16 bits
+  return (short)bsp.lump<int>(h.ledges)[pos];
 }
 
 u_short readLFace(int pos)
 {
-  fseek(f, h.lface.offset + sizeof(u_short) * pos, SEEK_SET);
-  u_short s;
-  fread(&s, sizeof(u_short), 1, f);
-  return s;
+  return bsp.lump<u_short>(h.lface)[pos];
+}
+
+// mip textures: the lump starts with the number of textures, followed
+// by the offset of each texture header from the start of the lump
+long numMiptex()
+{
+  return *bsp.at<long>(h.miptex.offset);
+}
+
+long miptexOffset(int t)
+{
+  sl_assert(t >= 0 && t < numMiptex());
+  return bsp.at<long>(h.miptex.offset, 1 + numMiptex())[1 + t];
+}
+
+miptex_t readMiptex(int t)
+{
+  return *bsp.at<miptex_t>(h.miptex.offset + miptexOffset(t));
 }
 
 v3f to_v3f(vertex_t v) { return v3f(v.x, v.y, v.z); }
@@ -314,13 +430,6 @@ void getLeafFaces(int leaf, std::vector< vector<v3f> >& _faces, std::vector<int>
   // read leaf
   dleaf_t lf;
   read(leaf, &lf);
-  // get texture header
-  fseek(f, h.miptex.offset, SEEK_SET);
-  long numtex;
-  fread(&numtex, sizeof(long), 1, f);
-  vector<long> offsets;
-  offsets.resize(numtex);
-  fread(&offsets[0], sizeof(long), numtex, f);
   // read faces
   for (int i = 0; i < lf.lface_num; ++i) {
     face_t fc;
@@ -329,9 +438,7 @@ void getLeafFaces(int leaf, std::vector< vector<v3f> >& _faces, std::vector<int>
     // check texture to eliminate trigger faces
     surface_t snfo;
     read(fc.texinfo_id, &snfo);
-    miptex_t tnfo;
-    fseek(f, h.miptex.offset + offsets[snfo.texture_id], SEEK_SET);
-    fread(&tnfo, sizeof(tnfo), 1, f);
+    miptex_t tnfo = readMiptex(snfo.texture_id);
     if (!strcmp(tnfo.name, "trigger")) {
       continue;
     }
@@ -359,7 +466,7 @@ void getLeafFaces(int leaf, std::vector< vector<v3f> >& _faces, std::vector<int>
 
 // --------------------------------------------------------------
 
-uchar *vlist = nullptr; // vislist global header
+const uchar *vlist = nullptr; // vislist global header
 
 // get vis list for a leaf
 void getLeafVislist(int leaf, std::vector<int>& _vis)
@@ -370,11 +477,7 @@ void getLeafVislist(int leaf, std::vector<int>& _vis)
   // parse vislist, https://www.gamers.org/dEngine/quake/spec/quake-spec34/qkspec_4.htm#BL4
   int v = lf.vislist;
   int numleaves = h.leaves.size / sizeof(dleaf_t);
-  if (vlist == nullptr) {
-    vlist = new uchar[h.visilist.size];
-    fseek(f, h.visilist.offset, SEEK_SET);
-    fread(vlist, 1, h.visilist.size, f);
-  }
+  sl_assert(vlist != nullptr); // set in main, before any thread starts
   for (int L = 1; L < numleaves; v++)
   {
     if (vlist[v] == 0)          // value 0, leaves invisible
@@ -396,44 +499,96 @@ void getLeafVislist(int leaf, std::vector<int>& _vis)
 
 // --------------------------------------------------------------
 
-// checks whether a vertex is already known in uniquep (very slow!)
-int search_vertex(v3f p, const vector<v3f>& uniquep)
+// Spatial hash of points in D dimensions, on a grid of cells as large as
+// the search tolerance: any point closer than that (along each axis) to a
+// query is in the query cell or one of its direct neighbours. Buckets list
+// ids in insertion order.
+template <int D>
+class spatial_hash
 {
-  for (int i = 0; i < uniquep.size(); ++i) {
-    if (length(p - uniquep[i]) < 0.5f) {
-      return i;
+private:
+  typedef Tuple<int, D> t_cell;
+  struct cell_hash {
+    size_t operator()(const t_cell& c) const {
+      size_t h = 0;
+      for (int i = 0; i < D; ++i) { h = h * 0x9E3779B1u + (size_t)(unsigned)c[i]; }
+      return h;
+    }
+  };
+  struct cell_eq {
+    bool operator()(const t_cell& a, const t_cell& b) const { return a == b; }
+  };
+  float m_cell;
+  unordered_map<t_cell, vector<int>, cell_hash, cell_eq> m_buckets;
+  t_cell cellOf(const Tuple<float, D>& p) const
+  {
+    t_cell c;
+    for (int i = 0; i < D; ++i) { c[i] = (int)floor(p[i] / m_cell); }
+    return c;
+  }
+public:
+  spatial_hash(float cell) : m_cell(cell) {}
+  void insert(const Tuple<float, D>& p, int id) { m_buckets[cellOf(p)].push_back(id); }
+  // smallest id around p for which match(id) holds, -1 if none; this is
+  // what a linear scan of the ids in insertion order returns
+  template <typename F>
+  int search(const Tuple<float, D>& p, F match) const
+  {
+    t_cell c = cellOf(p);
+    int best = -1;
+    int num  = 1;
+    for (int i = 0; i < D; ++i) { num *= 3; }
+    for (int n = 0; n < num; ++n) {
+      t_cell nc = c;
+      int k = n;
+      for (int i = 0; i < D; ++i) { nc[i] += (k % 3) - 1; k /= 3; }
+      auto B = m_buckets.find(nc);
+      if (B == m_buckets.end()) continue;
+      for (int id : B->second) {
+        if (best != -1 && id >= best) break; // ids are increasing
+        if (match(id)) { best = id; break; }
+      }
     }
+    return best;
   }
-  return -1;
+};
+
+// tolerances used to merge vertices, normals and texturing vectors
+const float vertex_tol  = 0.5f;   // distance
+const float normal_tol  = 0.999f; // dot product, unit vectors
+const float normal_cell = 0.05f;  // > sqrt(2 - 2*normal_tol)
+const float surface_tol = 0.1f;   // distS/distT difference
+
+// checks whether a vertex is already known in uniquep
+int search_vertex(v3f p, const vector<v3f>& uniquep, const spatial_hash<3>& hash)
+{
+  return hash.search(p, [&](int i) { return length(p - uniquep[i]) < vertex_tol; });
 }
 
 // compares two planar texture defs
 bool cmp_uv_vec(v4f a, v4f b)
 {
-  return (dot(v3f(a), v3f(b)) > 0.999f && fabs(a[3]-b[3]) < 0.1f);
+  return (dot(v3f(a), v3f(b)) > normal_tol && fabs(a[3]-b[3]) < surface_tol);
 }
 
-// checks whether a planar texture def is already known in uniques (very slow!)
-int search_surface(pair<v4f,v4f> srf, const vector<pair<v4f, v4f> >& uniques)
+// key of a planar texture def in the surface spatial hash
+v2f surface_key(const pair<v4f, v4f>& srf) { return v2f(srf.first[3], srf.second[3]); }
+
+// checks whether a planar texture def is already known in uniques
+// (hashed on the distances, the vectors are checked on candidates)
+int search_surface(pair<v4f,v4f> srf, const vector<pair<v4f, v4f> >& uniques, const spatial_hash<2>& hash)
 {
-  for (int i = 0; i < uniques.size(); ++i) {
-    if ( cmp_uv_vec(srf.first, uniques[i].first)
-      && cmp_uv_vec(srf.second,uniques[i].second)) {
-      return i;
-    }
-  }
-  return -1;
+  return hash.search(surface_key(srf), [&](int i) {
+    return cmp_uv_vec(srf.first, uniques[i].first)
+        && cmp_uv_vec(srf.second,uniques[i].second);
+  });
 }
 
-// checks whether a normal is already known in uniquen (very slow!)
-int search_normal(v3f n, const vector<v3f>& uniquen)
+// checks whether a normal is already known in uniquen
+// NOTE: unit normals with dot > normal_tol are closer than normal_cell
+int search_normal(v3f n, const vector<v3f>& uniquen, const spatial_hash<3>& hash)
 {
-  for (int i = 0; i < uniquen.size(); ++i) {
-    if (dot(n, uniquen[i]) > 0.999f) {
-      return i;
-    }
-  }
-  return -1;
+  return hash.search(n, [&](int i) { return dot(n, uniquen[i]) > normal_tol; });
 }
 
 // swaps y/z since in the demo the view is along z, not y
@@ -547,94 +702,175 @@ v2i lmap_dimensions(const face_t *fc,const vector<v3f>& face,v3f& _p_ref)
 
 int numlightmaps = 0; // counts light maps
 
-// a light map pack texture
+const int lmap_atlas_size = 256; // light map atlas width/height (uvs are 8 bits)
+const int lmap_padding    = 1;   // border around each light map, see lmap_pack_pad
+
+// a segment of the skyline: top of the packed area over [x,x+w[
+typedef struct {
+  int x, y, w;
+} skyline_seg;
+
+// a light map pack texture (atlas)
 typedef struct {
   uchar *pixels;
   int w, h;   // width and height of the pack
-  int ti, tj; // next free tile
-  int tw, th; // tile w and height
+  vector<skyline_seg> skyline; // packed area, left to right
   int tex_id; // pack texture id once determined
 } lmap_pack;
 
-// all light map packs, by power of two of lightmap tile size
-vector<vector<lmap_pack*> > lmap_packs;
+// all light map packs
+vector<lmap_pack*> lmap_packs;
 
 // prepares a light map pack
-lmap_pack *lmap_pack_pre(int sz,int tsz)
+lmap_pack *lmap_pack_pre(int sz)
 {
   lmap_pack *pack = new lmap_pack();
   pack->w         = pack->h = sz;
   pack->pixels    = new uchar[sz*sz];
   memset(pack->pixels, 0xff, sz * sz);
-  pack->ti = pack->tj = 0;
-  pack->tw = pack->th = tsz;
+  pack->skyline.push_back(skyline_seg{ 0, 0, sz });
   pack->tex_id = -1;
-  sl_assert(sz % pack->tw == 0);
-  sl_assert(sz % pack->th == 0);
   return pack;
 }
 
-// checks if the pack is full
-bool lmap_pack_full(lmap_pack *pack)
+// lowest y at which a w x h rectangle fits starting on skyline segment s,
+// -1 if it does not fit
+int lmap_pack_fit(const lmap_pack *pack,int s,int w,int h)
+{
+  const auto& sky = pack->skyline;
+  if (sky[s].x + w > pack->w) {
+    return -1;
+  }
+  int y    = 0;
+  int left = w;
+  for (int k = s; left > 0; ++k) {
+    y     = max(y, sky[k].y);
+    if (y + h > pack->h) {
+      return -1;
+    }
+    left -= sky[k].w;
+  }
+  return y;
+}
+
+// places a w x h rectangle (bottom-left rule: lowest top, then leftmost),
+// returns false if it does not fit
+bool lmap_pack_place(lmap_pack *pack,int w,int h,v2i& _pos)
 {
-  return pack->tj >= pack->h;
+  auto& sky  = pack->skyline;
+  int best_s = -1;
+  int best_y = 0;
+  for (int s = 0; s < (int)sky.size(); ++s) {
+    int y = lmap_pack_fit(pack, s, w, h);
+    if (y > -1 && (best_s == -1 || y < best_y)) {
+      best_s = s;
+      best_y = y;
+    }
+  }
+  if (best_s == -1) {
+    return false;
+  }
+  _pos = v2i(sky[best_s].x, best_y);
+  // insert the new segment, trim the ones it covers
+  skyline_seg seg{ sky[best_s].x, best_y + h, w };
+  sky.insert(sky.begin() + best_s, seg);
+  int k = best_s + 1;
+  while (k < (int)sky.size() && sky[k].x < seg.x + seg.w) {
+    int shrink = seg.x + seg.w - sky[k].x;
+    if (shrink >= sky[k].w) {
+      sky.erase(sky.begin() + k);
+    } else {
+      sky[k].x += shrink;
+      sky[k].w -= shrink;
+      break;
+    }
+  }
+  // merge neighbours of same height
+  for (k = 0; k + 1 < (int)sky.size(); ) {
+    if (sky[k].y == sky[k + 1].y) {
+      sky[k].w += sky[k + 1].w;
+      sky.erase(sky.begin() + k + 1);
+    } else {
+      ++k;
+    }
+  }
+  return true;
 }
 
-// adds a light map tile to the pack
-v2i lmap_pack_add(lmap_pack *pack,uchar *pixs,int w,int h)
+// adds a light map to the pack, with a padding border,
+// returns false if it does not fit
+bool lmap_pack_add(lmap_pack *pack,const uchar *pixs,int w,int h,v2i& _pos)
 {
-  sl_assert(w <= pack->tw && h <= pack->th);
-  sl_assert(!lmap_pack_full(pack));
+  v2i pos;
+  if (!lmap_pack_place(pack, w + 2 * lmap_padding, h + 2 * lmap_padding, pos)) {
+    return false;
+  }
+  _pos = pos + v2i(lmap_padding);
   for (int j = 0; j < h; ++j) {
     for (int i = 0; i < w; ++i) {
       float l = (float)pixs[i + j * w] / 255.0f;
       // l       = pow(l,0.9f);
       int il  = max(0,min(255, 32 + (int)floor(l*255.0f)));
-      pack->pixels[(i + pack->ti) + (j + pack->tj) * pack->w]
+      pack->pixels[(i + _pos[0]) + (j + _pos[1]) * pack->w]
         = il;
     }
   }
-  v2i pos = v2i(pack->ti, pack->tj);
-  pack->ti += pack->tw;
-  if (pack->ti == pack->w) {
-    pack->ti  = 0;
-    pack->tj += pack->th;
+  return true;
+}
+
+// height used in the pack
+int lmap_pack_used_height(const lmap_pack *pack)
+{
+  int y = 0;
+  for (const auto& seg : pack->skyline) {
+    y = max(y, seg.y);
   }
-  return pos;
+  return y;
 }
 
 // diffuse around light maps to fill-in the padding, hack to avoid cracks
 // in rendering as uvs are not precise anough to exactly align
-bool lmap_pack_pad(lmap_pack *pack)
-{
-  bool done = true;
-  uchar *tmp = new uchar[pack->w * pack->h];
-  memcpy(tmp, pack->pixels, pack->w * pack->h);
-  for (int j = 0; j < pack->h; ++j) {
-    for (int i = 0; i < pack->w; ++i) {
-      if (tmp[i + j * pack->h] == 0xff) {
-        // average nieghbors
-        int avg = 0;
-        int n = 0;
-        for (int y = max(0, j - 1); y <= min(pack->h - 1, j + 1); ++y) {
-          for (int x = max(0, i - 1); x <= min(pack->w - 1, i + 1); ++x) {
-            if (tmp[x + y * pack->h] != 0xff) {
-              avg += tmp[x + y * pack->h];
-              ++n;
-            }
-          }
-        }
-        if (n == 0) {
-          pack->pixels[i + j * pack->h] = 0xff;
-          done = false;
-        } else {
-          pack->pixels[i + j * pack->h] = avg / n;
+// Empty texels (0xff) are filled by layers of increasing distance (8
+// neighbours) to the light maps, each with the average of its neighbours
+// from the previous layers. This is a breadth first traversal visiting
+// each texel once, equivalent to repeated 3x3 averaging passes.
+void lmap_pack_pad(lmap_pack *pack)
+{
+  int w = pack->w;
+  int h = pack->h;
+  vector<int> dist(w * h, -1);
+  vector<int> queue;
+  queue.reserve(w * h);
+  for (int t = 0; t < w * h; ++t) {
+    if (pack->pixels[t] != 0xff) {
+      dist[t] = 0;
+      queue.push_back(t);
+    }
+  }
+  for (size_t q = 0; q < queue.size(); ++q) {
+    int t = queue[q];
+    int i = t % w;
+    int j = t / w;
+    int avg = 0;
+    int n = 0;
+    for (int y = max(0, j - 1); y <= min(h - 1, j + 1); ++y) {
+      for (int x = max(0, i - 1); x <= min(w - 1, i + 1); ++x) {
+        int nt = x + y * w;
+        if (dist[nt] == -1) {
+          // next layer
+          dist[nt] = dist[t] + 1;
+          queue.push_back(nt);
+        } else if (dist[nt] < dist[t]) {
+          // previous layer, already filled
+          avg += pack->pixels[nt];
+          ++n;
         }
       }
     }
+    if (dist[t] > 0) {
+      pack->pixels[t] = avg / n;
+    }
   }
-  delete[](tmp);
-  return done;
 }
 
 // saves a lightmap pack for visualization purposes
@@ -665,13 +901,20 @@ typedef struct {
 
 map<int, lmap_nfo > face_to_lmap; // stores light map info for faces
 
-// extracts all lights maps for leaf l
-void extractLightMaps(int l)
+// a light map waiting to be packed
+typedef struct {
+  int           fid;
+  v2i           dim;
+  vector<uchar> pixels;
+} lmap_src;
+
+vector<lmap_src> lmap_srcs; // light maps to be packed, see packLightMaps
+
+// extracts all lights maps for leaf l, given its faces (see getLeafFaces)
+void extractLightMaps(int l,
+  const std::vector<vector<v3f> >& faces,
+  const std::vector<int>&          face_ids)
 {
-  /// get faces
-  std::vector<vector<v3f> >  faces;
-  std::vector<int>           face_ids;
-  getLeafFaces(l, faces, face_ids);
   /// light maps
   for (int fi = 0; fi < face_ids.size(); ++fi) {
     int fid = face_ids[fi];
@@ -686,24 +929,18 @@ void extractLightMaps(int l)
       v3f pref;
       v2i ldim = lmap_dimensions(&fc, faces[fi], pref);
       long lmap_start = fc.lightmap;
-      long lmap_end = fc.lightmap + ldim[0] * ldim[1];
       // read lightmap
-      uchar *lmap = new uchar[ldim[0] * ldim[1]];
-      fseek(f, h.lightmaps.offset + lmap_start, SEEK_SET);
-      fread(lmap, ldim[0] * ldim[1], 1, f);
-      // add to pack
-      int p2 = selectLmapPow2(tupleMax(ldim));
-      if (lmap_packs[p2].empty()) {
-        lmap_packs[p2].push_back(lmap_pack_pre(256, 1 << p2));
-      } else if (lmap_pack_full(lmap_packs[p2].back())) {
-        lmap_packs[p2].push_back(lmap_pack_pre(256, 1 << p2));
-      }
-      v2i pos = lmap_pack_add(lmap_packs[p2].back(), lmap, ldim[0], ldim[1]);
-      sl_assert(face_to_lmap.count(fid) == 0);
+      lmap_src src;
+      src.fid = fid;
+      src.dim = ldim;
+      src.pixels.resize(ldim[0] * ldim[1]);
+      memcpy(&src.pixels[0], bsp.at<uchar>(h.lightmaps.offset + lmap_start, ldim[0] * ldim[1]), ldim[0] * ldim[1]);
+      lmap_srcs.push_back(src);
+      // placed later by packLightMaps
       lmap_nfo nfo;
-      nfo.pack = lmap_packs[p2].back();
-      nfo.uv_pos = pos;
-      nfo.pref = pref;
+      nfo.pack   = nullptr;
+      nfo.uv_pos = v2i(0);
+      nfo.pref   = pref;
       face_to_lmap[fid] = nfo;
 #if 0
       // save lightmap
@@ -713,108 +950,571 @@ void extractLightMaps(int l)
       img.height = ldim[1];
       img.pixels = new uchar[ldim[0] * ldim[1] * 3];
       for (int i = 0; i < ldim[0] * ldim[1]; ++i) {
-        img.pixels[i * 3 + 0] = lmap[i];
-        img.pixels[i * 3 + 1] = lmap[i];
-        img.pixels[i * 3 + 2] = lmap[i];
+        img.pixels[i * 3 + 0] = src.pixels[i];
+        img.pixels[i * 3 + 1] = src.pixels[i];
+        img.pixels[i * 3 + 2] = src.pixels[i];
       }
       SaveTGAFile((std::string(SRC_PATH) + sprint("lmaps\\%04d.tga", fid)).c_str(), &img);
       delete[](img.pixels);
 #endif
-      delete[](lmap);
     }
   }
 }
 
+// packs all extracted light maps in as few atlases as possible
+void packLightMaps()
+{
+  // estimate of the former scheme: pow2 tiles, one pack series per tile size
+  int texels = 0;
+  map<int, int> per_tile_size;
+  for (const auto& src : lmap_srcs) {
+    texels += src.dim[0] * src.dim[1];
+    ++per_tile_size[selectLmapPow2(tupleMax(src.dim))];
+  }
+  int tiled_packs = 0;
+  for (auto ts : per_tile_size) {
+    int per_pack = (lmap_atlas_size >> ts.first) * (lmap_atlas_size >> ts.first);
+    tiled_packs += (ts.second + per_pack - 1) / per_pack;
+  }
+  int tiled_area = tiled_packs * lmap_atlas_size * lmap_atlas_size;
+  // largest first, stable so that the result is deterministic
+  vector<int> order(lmap_srcs.size());
+  for (int i = 0; i < (int)order.size(); ++i) { order[i] = i; }
+  stable_sort(order.begin(), order.end(), [](int a, int b) {
+    const v2i& da = lmap_srcs[a].dim;
+    const v2i& db = lmap_srcs[b].dim;
+    if (da[1] != db[1]) return da[1] > db[1];
+    return da[0] > db[0];
+  });
+  // skyline packing, first atlas that fits
+  for (int i : order) {
+    const lmap_src& src = lmap_srcs[i];
+    sl_assert(src.dim[0] + 2 * lmap_padding <= lmap_atlas_size
+           && src.dim[1] + 2 * lmap_padding <= lmap_atlas_size);
+    lmap_nfo& nfo = face_to_lmap.at(src.fid);
+    for (auto pk : lmap_packs) {
+      if (lmap_pack_add(pk, &src.pixels[0], src.dim[0], src.dim[1], nfo.uv_pos)) {
+        nfo.pack = pk;
+        break;
+      }
+    }
+    if (nfo.pack == nullptr) {
+      lmap_packs.push_back(lmap_pack_pre(lmap_atlas_size));
+      bool ok = lmap_pack_add(lmap_packs.back(), &src.pixels[0], src.dim[0], src.dim[1], nfo.uv_pos);
+      sl_assert(ok);
+      nfo.pack = lmap_packs.back();
+    }
+  }
+  // shrink the last atlas to the used height (power of two)
+  int packed_area = 0;
+  if (!lmap_packs.empty()) {
+    lmap_pack *last = lmap_packs.back();
+    last->h = 1 << justHigherPow2(max(1, lmap_pack_used_height(last)));
+    packed_area = (int)(lmap_packs.size() - 1) * lmap_atlas_size * lmap_atlas_size
+                + last->w * last->h;
+  }
+  // report
+  printf("light maps: %d texels\n", texels);
+  printf("  pow2 tiles (before): %d packs, %d texels, occupancy %.1f%%\n",
+    tiled_packs, tiled_area, tiled_area ? 100.0f * texels / tiled_area : 0.0f);
+  printf("  skyline    (after) : %d packs, %d texels, occupancy %.1f%%\n",
+    (int)lmap_packs.size(), packed_area, packed_area ? 100.0f * texels / packed_area : 0.0f);
+}
+
+// --------------------------------------------------------------
+
+// Stage cache: the output of a stage is stored on disk under a hash of
+// its inputs (BSP lumps, options), and reused while they are unchanged.
+// NOTE: bump a stage version when changing the code of the stage
+
+string cache_dir = SRC_PATH "cache"; // see -cache, empty disables
+
+const int cache_version_textures  = 2;
+const int cache_version_lightmaps = 1;
+const int cache_version_bsp       = 1;
+const int cache_version_leaves    = 2;
+const int cache_version_facevis   = 1;
+
+// time spent in each stage, printed at the end
+typedef struct {
+  string name; // map and stage
+  double ms;
+  bool   cached;
+} stage_time;
+
+vector<stage_time> stage_times;
+
+typedef std::chrono::steady_clock::time_point stage_clock;
+
+stage_clock stageStart()
+{
+  return std::chrono::steady_clock::now();
+}
+
+string stage_map; // map being processed, for the report
+
+void stageEnd(const string& name, stage_clock start, bool cached)
+{
+  std::chrono::duration<double, std::milli> el = std::chrono::steady_clock::now() - start;
+  stage_times.push_back(stage_time{ stage_map + " " + name, el.count(), cached });
+}
+
+// FNV-1a, 64 bits
+uint64_t fnv1a(const void *ptr, size_t sz, uint64_t hash = 14695981039346656037ull)
+{
+  const uchar *b = (const uchar *)ptr;
+  for (size_t i = 0; i < sz; ++i) {
+    hash ^= b[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// hashes a value into a key
+template <typename T>
+uint64_t keyAdd(uint64_t key, const T& v)
+{
+  return fnv1a(&v, sizeof(T), key);
+}
+
+// hashes lumps of the current BSP into a key
+uint64_t keyLumps(uint64_t key, std::initializer_list<const dentry_t*> lumps)
+{
+  for (auto e : lumps) {
+    key = keyAdd(key, e->size);
+    key = fnv1a(bsp.at<uchar>(e->offset, e->size), e->size, key);
+  }
+  return key;
+}
+
+// appends values and vectors to a byte buffer
+template <typename T>
+void bput(vector<uchar>& _buf, const T& v)
+{
+  const uchar *b = (const uchar *)&v;
+  _buf.insert(_buf.end(), b, b + sizeof(T));
+}
+
+template <typename T>
+void bput(vector<uchar>& _buf, const vector<T>& v)
+{
+  bput(_buf, (int)v.size());
+  if (!v.empty()) {
+    const uchar *b = (const uchar *)&v[0];
+    _buf.insert(_buf.end(), b, b + sizeof(T) * v.size());
+  }
+}
+
+// reads back from a byte buffer, in the same order
+typedef struct {
+  const vector<uchar> *buf;
+  size_t               pos;
+} bstream;
+
+template <typename T>
+void bget(bstream& _s, T& _v)
+{
+  sl_assert(_s.pos + sizeof(T) <= _s.buf->size());
+  memcpy(&_v, &(*_s.buf)[_s.pos], sizeof(T));
+  _s.pos += sizeof(T);
+}
+
+template <typename T>
+void bget(bstream& _s, vector<T>& _v)
+{
+  int n;
+  bget(_s, n);
+  sl_assert(n >= 0 && _s.pos + sizeof(T) * n <= _s.buf->size());
+  _v.resize(n);
+  if (n > 0) {
+    memcpy(&_v[0], &(*_s.buf)[_s.pos], sizeof(T) * n);
+  }
+  _s.pos += sizeof(T) * n;
+}
+
+string cachePath(const char *stage, uint64_t key)
+{
+  return cache_dir + "/" + stage + sprint("-%016llx.bin", (unsigned long long)key);
+}
+
+// loads the cached output of a stage, false if not in cache
+bool cacheLoad(const char *stage, uint64_t key, vector<uchar>& _bytes)
+{
+  if (cache_dir.empty()) {
+    return false;
+  }
+  FILE *f = fopen(cachePath(stage, key).c_str(), "rb");
+  if (f == NULL) {
+    return false;
+  }
+  uint64_t fkey = 0;
+  long     sz   = -1;
+  bool     ok   = fread(&fkey, sizeof(fkey), 1, f) == 1 && fread(&sz, sizeof(sz), 1, f) == 1
+              && fkey == key && sz >= 0;
+  if (ok) {
+    _bytes.resize(sz);
+    ok = sz == 0 || fread(&_bytes[0], 1, sz, f) == (size_t)sz;
+  }
+  fclose(f);
+  return ok; // a truncated file is rebuilt
+}
+
+// stores the output of a stage
+void cacheStore(const char *stage, uint64_t key, const vector<uchar>& bytes)
+{
+  if (cache_dir.empty()) {
+    return;
+  }
+#ifdef _WIN32
+  CreateDirectoryA(cache_dir.c_str(), NULL);
+#else
+  mkdir(cache_dir.c_str(), 0755);
+#endif
+  FILE *f = fopen(cachePath(stage, key).c_str(), "wb");
+  if (f == NULL) {
+    fprintf(stderr, "[warning] cannot write to cache %s\n", cache_dir.c_str());
+    return;
+  }
+  long sz = (long)bytes.size();
+  fwrite(&key, sizeof(key), 1, f);
+  fwrite(&sz, sizeof(sz), 1, f);
+  if (sz > 0) {
+    fwrite(&bytes[0], 1, sz, f);
+  }
+  fclose(f);
+}
+
+// --------------------------------------------------------------
+
+// Textures are shared by all maps of a pack: the GPU texture table sits at
+// the start of the pack (2MB in flash) and covers all texture ids, game
+// textures are deduplicated across maps by content.
+
+const int max_textures = 1024; // GPU texture ids are 10 bits
+const int num_mips     = 4;    // miptex levels (offset1, offset2, offset4, offset8)
+
+// mip levels of game textures are packed as consecutive texture ids,
+// q5k selects level k of a face texture with texid + k
+bool pack_mips = true;
+
+int texLevels() { return pack_mips ? num_mips : 1; }
+
+// a game texture, padded to power of two sizes
+typedef struct {
+  int           wp2, hp2;
+  vector<uchar> pixels;             // level 0
+  vector<uchar> mips[num_mips - 1]; // levels 1 to 3, each half the previous
+} pack_texture;
+
+vector<pack_texture>              textures;      // game textures of all maps
+unordered_multimap<uint64_t, int> textures_hash; // content hash => textures
+vector<int>                       miptex_to_tex; // current map miptex => textures
+vector<lmap_pack*>                pack_lmaps;    // light map atlases of all maps
+
+// pads a miptex level to power of two sizes, repeating the texture
+vector<uchar> padLevel(const uchar *pixs, int w, int h, int wp2, int hp2)
+{
+  vector<uchar> padded((1 << wp2) * (1 << hp2));
+  for (int j = 0; j < (1 << hp2); ++j) {
+    for (int i = 0; i < (1 << wp2); ++i) {
+      padded[i + j * (1 << wp2)] = pixs[(i % w) + (j % h) * w];
+    }
+  }
+  return padded;
+}
+
+// converts the mip textures of the current map (all levels, padded)
+vector<pack_texture> convertTextures()
+{
+  vector<pack_texture> texs;
+  int numtex = numMiptex();
+  for (int t = 0; t < numtex; ++t) {
+    // read nfo
+    miptex_t tnfo = readMiptex(t);
+    pack_texture tex;
+    tex.wp2 = tex.hp2 = 0;
+    if (tnfo.name[0] != '\0') { // a strange entry in e1m2 has no name and no data
+      // make padded versions of each level (miptex sizes are multiples of 8)
+      tex.wp2 = justHigherPow2(tnfo.width);
+      tex.hp2 = justHigherPow2(tnfo.height);
+      u_long offsets[num_mips] = { tnfo.offset1, tnfo.offset2, tnfo.offset4, tnfo.offset8 };
+      for (int l = 0; l < num_mips; ++l) {
+        int mw = tnfo.width >> l, mh = tnfo.height >> l;
+        const uchar *pixs = bsp.at<uchar>(h.miptex.offset + miptexOffset(t) + offsets[l], mw * mh);
+        vector<uchar> padded = padLevel(pixs, mw, mh, max(tex.wp2 - l, 0), max(tex.hp2 - l, 0));
+        if (l == 0) {
+          tex.pixels = padded;
+        } else {
+          tex.mips[l - 1] = padded;
+        }
+      }
+    }
+    texs.push_back(tex);
+  }
+  return texs;
+}
+
+// reads the mip textures of the current map, textures already seen in
+// a previous map are reused (returns the number of new textures)
+int gatherTextures(vector<int>& _miptex_to_tex)
+{
+  /// convert, or reuse the cached conversion
+  stage_clock tm = stageStart();
+  uint64_t ckey  = keyLumps(keyAdd(0, cache_version_textures), { &h.miptex });
+  vector<pack_texture> texs;
+  vector<uchar>        bytes;
+  bool cached = cacheLoad("textures", ckey, bytes);
+  if (cached) {
+    bstream bs = { &bytes, 0 };
+    int n;
+    bget(bs, n);
+    texs.resize(n);
+    for (auto& tex : texs) {
+      bget(bs, tex.wp2);
+      bget(bs, tex.hp2);
+      bget(bs, tex.pixels);
+      for (auto& mip : tex.mips) { bget(bs, mip); }
+    }
+  } else {
+    texs = convertTextures();
+    bput(bytes, (int)texs.size());
+    for (const auto& tex : texs) {
+      bput(bytes, tex.wp2);
+      bput(bytes, tex.hp2);
+      bput(bytes, tex.pixels);
+      for (const auto& mip : tex.mips) { bput(bytes, mip); }
+    }
+    cacheStore("textures", ckey, bytes);
+  }
+  stageEnd("textures", tm, cached);
+  /// deduplicate
+  _miptex_to_tex.clear();
+  int num_new = 0;
+  for (const auto& tex : texs) {
+    // search for the same content
+    uint64_t key = fnv1a(&tex.wp2, sizeof(int));
+    key = fnv1a(&tex.hp2, sizeof(int), key);
+    key = tex.pixels.empty() ? key : fnv1a(&tex.pixels[0], tex.pixels.size(), key);
+    int id = -1;
+    auto range = textures_hash.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+      const pack_texture& other = textures[it->second];
+      if (other.wp2 == tex.wp2 && other.hp2 == tex.hp2 && other.pixels == tex.pixels) {
+        id = it->second;
+        break;
+      }
+    }
+    if (id == -1) {
+      id = (int)textures.size();
+      textures_hash.insert(make_pair(key, id));
+      textures.push_back(tex);
+      ++num_new;
+    }
+    _miptex_to_tex.push_back(id);
+  }
+  return num_new;
+}
+
 // --------------------------------------------------------------
 
 map<int, int> face_usage;    // tracks face usage for debugging purposes
 int           max_verts = 0; // max num vertices in a leaf
 
-// packs a leaf in the data pack
-void packLeaf(
-  FILE        *pack,
-  int          l,
-  vector<v3f>&            _global_uniquen,
-  vector<pair<v4f,v4f> >& _global_uniques,
-  int&         _vis_first)
-{
-  /// get faces
+// leaf format, written in the low byte of the leaf header (flags in high byte)
+const int leaf_format     = 4;
+const int leaf_flag_idx16 = 1; // indices are uint16 (uint8 otherwise)
+const int leaf_flag_vtx8  = 2; // vertices are 3 x 8 bits deltas to a base
+const int leaf_flag_vtx10 = 4; // vertices are 3 x 10 bits deltas to a base
+const int leaf_flag_gids  = 8; // vertices are followed by their global ids
+
+// encodes vertices as deltas to the leaf minimum corner when they fit
+bool pack_vertex_deltas = true;
+
+// gives leaf vertices a global id, shared by leaves (same fixed point
+// position), q5k then transforms a vertex once per frame
+bool pack_vertex_ids = true;
+
+// leaf payload, gathered independently for each leaf
+typedef struct {
   std::vector<vector<v3f> >  faces;
   std::vector<int>           face_ids;
-  getLeafFaces(l, faces, face_ids);
-  /// texture ids
-  vector<int>      face_texids;
-  std::vector<int> faces_tvc_idx;
-  faces_tvc_idx.resize(faces.size());
-  int fidx = 0;
-  for (auto fid : face_ids) {
-    ++ face_usage[fid];
+  vector<int>                face_texids;
+  vector<pair<v4f, v4f> >    face_srfs;     // texturing vectors, per face
+  vector<v3f>                face_nrms;     // normals, faces with >= 3 vertices
+  vector<v3f>                uniquev;       // leaf vertices
+  std::vector<vector<int> >  ifaces;        // faces as lists of vertex ids
+  vector<int>                vis;           // visibility list
+  // resolved by the serial merge, in leaf order
+  std::vector<int>           faces_tvc_idx;
+  std::vector<int>           faces_nrm_idx;
+  vector<int>                vtx_gids;      // global vertex ids
+  int                        vis_first = 0;
+  // leaf record, as written in the pack
+  vector<uchar>              bytes;
+} leaf_payload;
+
+// appends to a byte buffer, same arguments as fwrite
+void bwrite(const void *ptr, size_t sz, size_t n, vector<uchar>& _buf)
+{
+  const uchar *b = (const uchar *)ptr;
+  _buf.insert(_buf.end(), b, b + sz * n);
+}
+
+// number of threads packing leaves, 0 uses all cores
+int num_threads = 0;
+
+// calls f(i) for i in [0,n[ on a pool of threads
+template <typename F>
+void parallel_for(int n, F f)
+{
+  int nt = num_threads > 0 ? num_threads : (int)std::thread::hardware_concurrency();
+  nt = max(1, min(nt, n));
+  std::atomic<int> next(0);
+  vector<std::thread> pool;
+  for (int t = 0; t < nt; ++t) {
+    pool.push_back(std::thread([&]() {
+      while (1) {
+        int i = next++;
+        if (i >= n) break;
+        f(i);
+      }
+    }));
+  }
+  for (auto& th : pool) { th.join(); }
+}
+
+// gathers a leaf: faces, unique vertices, indices, vislist
+// NOTE: only reads the BSP, safe to call from multiple threads
+void gatherLeaf(int l, leaf_payload& _lp)
+{
+  /// get faces
+  getLeafFaces(l, _lp.faces, _lp.face_ids);
+  /// texture ids and texturing vectors
+  for (auto fid : _lp.face_ids) {
     face_t fc;
     read(fid, &fc);
     surface_t tnfo;
     read(fc.texinfo_id, &tnfo);
-    face_texids.push_back(tnfo.texture_id);
-    // surface test
-    pair<v4f, v4f> s = make_pair(
+    _lp.face_texids.push_back(tnfo.texture_id);
+    _lp.face_srfs.push_back(make_pair(
       v4f(to_v3f(tnfo.vectorS), tnfo.distS),
       v4f(to_v3f(tnfo.vectorT), tnfo.distT)
-      );
-    int idx = search_surface(s, _global_uniques);
+      ));
+  }
+  /// face normals
+  for (const auto& f : _lp.faces) {
+    if (f.size() < 3) continue;
+    _lp.face_nrms.push_back(face_normal(f));
+  }
+  /// merge vertices
+  spatial_hash<3> uniquev_hash(vertex_tol);
+  for (const auto& f : _lp.faces) {
+    for (const auto& p : f) {
+      int idx = search_vertex(p, _lp.uniquev, uniquev_hash);
+      if (idx == -1) {
+        uniquev_hash.insert(p, (int)_lp.uniquev.size());
+        _lp.uniquev.push_back(p);
+      }
+    }
+  }
+  /// rewrite faces as lists of vertex ids
+  _lp.ifaces.reserve(_lp.faces.size());
+  for (const auto& f : _lp.faces) {
+    _lp.ifaces.push_back(vector<int>());
+    _lp.ifaces.back().reserve(f.size());
+    for (const auto& p : f) {
+      _lp.ifaces.back().push_back(search_vertex(p, _lp.uniquev, uniquev_hash));
+    }
+  }
+  /// visibility list
+  getLeafVislist(l, _lp.vis);
+}
+
+// leaf vertex in fixed point, as written in the pack
+v3s packedVertex(v3f p)
+{
+  v3s iv = v3s(scale * p);
+  coord_swap(iv);
+  return iv;
+}
+
+// resolves the global normal, texturing vector and vertex ids of a leaf
+// NOTE: called in leaf order, ids are then independent of threading
+void resolveLeaf(
+  leaf_payload&                 _lp,
+  vector<v3f>&                  _global_uniquen,
+  spatial_hash<3>&              _global_uniquen_hash,
+  vector<pair<v4f,v4f> >&       _global_uniques,
+  spatial_hash<2>&              _global_uniques_hash,
+  unordered_map<uint64_t, int>& _global_vtx,
+  int&                          _vis_first)
+{
+  /// texturing vectors
+  _lp.faces_tvc_idx.resize(_lp.faces.size());
+  int fidx = 0;
+  for (auto fid : _lp.face_ids) {
+    ++ face_usage[fid];
+    const pair<v4f, v4f>& s = _lp.face_srfs[fidx];
+    int idx = search_surface(s, _global_uniques, _global_uniques_hash);
     if (idx == -1) {
       idx = _global_uniques.size();
       _global_uniques.push_back(s);
+      _global_uniques_hash.insert(surface_key(s), idx);
     }
-    faces_tvc_idx[fidx] = idx;
+    _lp.faces_tvc_idx[fidx] = idx;
     ++fidx;
   }
-  /// compute face normal/surface
-  std::vector<int> faces_nrm_idx;
-  faces_nrm_idx.resize(faces.size());
+  /// normals
+  _lp.faces_nrm_idx.resize(_lp.faces.size());
   fidx = 0;
-  for (const auto& f : faces) {
-    if (f.size() < 3) continue;
-    v3f n = face_normal(f);
-    int idx = search_normal(n, _global_uniquen);
+  for (const auto& n : _lp.face_nrms) {
+    int idx = search_normal(n, _global_uniquen, _global_uniquen_hash);
     if (idx == -1) {
       idx = _global_uniquen.size();
       _global_uniquen.push_back(n);
+      _global_uniquen_hash.insert(n, idx);
     }
-    faces_nrm_idx[fidx] = idx;
+    _lp.faces_nrm_idx[fidx] = idx;
     ++fidx;
   }
-  /// merge vertices
-  vector<v3f>  uniquev;
-  int numins = 0;
-  for (const auto& f : faces) {
-    for (const auto& p : f) {
-      int idx = search_vertex(p, uniquev);
-      if (idx == -1) {
-        uniquev.push_back(p);
-      }
-      ++numins;
+  max_verts = max(max_verts, (int)_lp.uniquev.size());
+  /// vertices, by exact packed position
+  _lp.vtx_gids.clear();
+  for (const auto& p : _lp.uniquev) {
+    v3s      iv  = packedVertex(p);
+    uint64_t key = (uint64_t)(u_short)iv[0] | ((uint64_t)(u_short)iv[1] << 16) | ((uint64_t)(u_short)iv[2] << 32);
+    auto     it  = _global_vtx.find(key);
+    int      gid = it == _global_vtx.end() ? (int)_global_vtx.size() : it->second;
+    if (it == _global_vtx.end()) {
+      _global_vtx.insert(make_pair(key, gid));
     }
+    _lp.vtx_gids.push_back(gid);
   }
-  max_verts = max(max_verts, (int)uniquev.size());
-  /// rewrite faces as lists of vertex ids
-  std::vector<vector<int> > ifaces;
-  ifaces.reserve(faces.size());
-  int num_indices = 0;
-  for (const auto& f : faces) {
-    ifaces.push_back(vector<int>());
-    ifaces.back().reserve(f.size());
-    for (const auto& p : f) {
-      ifaces.back().push_back(search_vertex(p, uniquev));
-      ++num_indices;
-    }
-  }
-  /// visibility list
-  vector<int> vis;
-  getLeafVislist(l, vis);
-  int vis_len = (int)vis.size();
+  /// visibility list start
+  _lp.vis_first = _vis_first;
+  _vis_first   += (int)_lp.vis.size();
+}
+
+// produces the leaf record in _lp.bytes
+// NOTE: only reads the global tables, safe to call from multiple threads
+void packLeaf(
+  int                     l,
+  leaf_payload&           _lp,
+  const vector<v3f>&      _global_uniquen)
+{
+  const auto& faces         = _lp.faces;
+  const auto& face_ids      = _lp.face_ids;
+  const auto& face_texids   = _lp.face_texids;
+  const auto& faces_tvc_idx = _lp.faces_tvc_idx;
+  const auto& faces_nrm_idx = _lp.faces_nrm_idx;
+  const auto& uniquev       = _lp.uniquev;
+  const auto& ifaces        = _lp.ifaces;
+  int vis_len = (int)_lp.vis.size();
+  int fidx    = 0;
 #if 0
   // print info
-  printf("leaf %d, %d vertices (/%d), %d faces, vis first: %d, len:%d\n",
-    l, uniquev.size(), numins, faces.size(), _vis_first,vis_len);
+  printf("leaf %d, %d vertices, %d faces, vis first: %d, len:%d\n",
+    l, uniquev.size(), faces.size(), _lp.vis_first,vis_len);
 #endif
   /// output
   // -> bounding box
@@ -822,75 +1522,172 @@ void packLeaf(
   read(l, &llf);
   short v;
   v = llf.bound.min_x * scale;
-  fwrite(&v, sizeof(short), 1, pack);
+  bwrite(&v, sizeof(short), 1, _lp.bytes);
   v = llf.bound.min_z * scale; // swap z<->y
-  fwrite(&v, sizeof(short), 1, pack);
+  bwrite(&v, sizeof(short), 1, _lp.bytes);
   v = llf.bound.min_y * scale;
-  fwrite(&v, sizeof(short), 1, pack);
+  bwrite(&v, sizeof(short), 1, _lp.bytes);
   v = llf.bound.max_x * scale;
-  fwrite(&v, sizeof(short), 1, pack);
+  bwrite(&v, sizeof(short), 1, _lp.bytes);
   v = llf.bound.max_z * scale; // swap z<->y
-  fwrite(&v, sizeof(short), 1, pack);
+  bwrite(&v, sizeof(short), 1, _lp.bytes);
   v = llf.bound.max_y * scale;
-  fwrite(&v, sizeof(short), 1, pack);
+  bwrite(&v, sizeof(short), 1, _lp.bytes);
   // -> vis list start and length
-  fwrite(&_vis_first, sizeof(int), 1, pack);
-  fwrite(&vis_len, sizeof(int), 1, pack);
-  // -> vertices
+  bwrite(&_lp.vis_first, sizeof(int), 1, _lp.bytes);
+  bwrite(&vis_len, sizeof(int), 1, _lp.bytes);
   int numv = (int)uniquev.size();
-  fwrite(&numv, sizeof(int), 1, pack);
-  for (int v = 0; v < uniquev.size(); ++v) {
-    v3s iv = v3s(scale * uniquev[v]);
-    coord_swap(iv);
-    fwrite(&iv[0], sizeof(short), 1, pack);
-    fwrite(&iv[1], sizeof(short), 1, pack);
-    fwrite(&iv[2], sizeof(short), 1, pack);
+  int numf = (int)faces.size();
+  sl_assert(numv < 65536 && numf < 65536);
+  bool wide = numv > 256; // indices fit a byte in most leaves
+  // -> vertices in fixed point, deltas to their minimum corner
+  vector<v3s> ivs;
+  v3s         base(0, 0, 0);
+  for (int v = 0; v < numv; ++v) {
+    v3s iv = packedVertex(uniquev[v]);
+    ivs.push_back(iv);
+    for (int c = 0; c < 3; ++c) {
+      base[c] = v == 0 ? iv[c] : min(base[c], iv[c]);
+    }
+  }
+  int shift = 0; // largest shift keeping deltas lossless
+  while (shift < 15) {
+    bool ok = true;
+    for (const auto& iv : ivs) {
+      for (int c = 0; c < 3; ++c) {
+        if ((((int)iv[c] - (int)base[c]) >> shift) & 1) { ok = false; }
+      }
+    }
+    if (!ok) break;
+    ++shift;
+  }
+  int max_delta = 0;
+  for (const auto& iv : ivs) {
+    for (int c = 0; c < 3; ++c) {
+      max_delta = max(max_delta, ((int)iv[c] - (int)base[c]) >> shift);
+    }
+  }
+  int vtx = 0;
+  if (pack_vertex_deltas && numv > 0) {
+    if      (max_delta < 256)  { vtx = leaf_flag_vtx8;  }
+    else if (max_delta < 1024) { vtx = leaf_flag_vtx10; }
+  }
+  if (vtx == 0) { shift = 0; }
+  bool gids = pack_vertex_ids && numv > 0;
+  // -> leaf header, four shorts
+  unsigned short hdr[4];
+  hdr[0] = leaf_format | (((wide ? leaf_flag_idx16 : 0) | vtx | (gids ? leaf_flag_gids : 0)) << 8);
+  hdr[1] = (unsigned short)numv;
+  hdr[2] = (unsigned short)numf;
+  hdr[3] = (unsigned short)shift;
+  bwrite(&hdr[0], sizeof(unsigned short), 4, _lp.bytes);
+  // -> vertices
+  int vtx_bytes = 0;
+  if (vtx == 0) {
+    // absolute
+    for (const auto& iv : ivs) {
+      bwrite(&iv[0], sizeof(short), 3, _lp.bytes);
+      vtx_bytes += 3 * sizeof(short);
+    }
+  } else {
+    // base, then deltas
+    short vhdr[4] = { base[0], base[1], base[2], 0 };
+    bwrite(&vhdr[0], sizeof(short), 4, _lp.bytes);
+    for (const auto& iv : ivs) {
+      unsigned int d[3];
+      for (int c = 0; c < 3; ++c) {
+        d[c] = ((int)iv[c] - (int)base[c]) >> shift;
+      }
+      if (vtx == leaf_flag_vtx8) {
+        uchar b[3] = { (uchar)d[0], (uchar)d[1], (uchar)d[2] };
+        bwrite(&b[0], 1, 3, _lp.bytes);
+        vtx_bytes += 3;
+      } else {
+        unsigned int w = d[0] | (d[1] << 10) | (d[2] << 20);
+        bwrite(&w, sizeof(unsigned int), 1, _lp.bytes);
+        vtx_bytes += 4;
+      }
+    }
+  }
+  while (vtx_bytes & 3) { // pad so that face records are 4-bytes aligned
+    uchar pad = 0;
+    bwrite(&pad, 1, 1, _lp.bytes);
+    ++vtx_bytes;
+  }
+  // -> global vertex ids, padded to 4 bytes
+  if (gids) {
+    for (int gid : _lp.vtx_gids) {
+      sl_assert(gid < 65536);
+      unsigned short s = (unsigned short)gid;
+      bwrite(&s, sizeof(unsigned short), 1, _lp.bytes);
+    }
+    if (numv & 1) {
+      unsigned short pad = 0;
+      bwrite(&pad, sizeof(unsigned short), 1, _lp.bytes);
+    }
   }
   // -> faces
-  //    face defs
-  int numf = (int)faces.size();
-  fwrite(&numf, sizeof(int), 1, pack);
-  short start = 0;
+  //    face records, five ints, indices of a face follow those of the
+  //    previous face (no start index)
   fidx = 0;
   for (const auto& f : ifaces) {
-    fwrite(&start, sizeof(short), 1, pack); // start index
-    short sz     = (short)f.size();
-    fwrite(&sz, sizeof(short), 1, pack);    // number of indices
-    short nrm    = faces_nrm_idx[fidx];
-    fwrite(&nrm, sizeof(short), 1, pack);   // index of normal
-    short tvc    = faces_tvc_idx[fidx];
-    fwrite(&tvc, sizeof(short), 1, pack);   // index of texturing info
-    short texid  = 2 + face_texids[fidx];
-    fwrite(&texid, sizeof(short), 1, pack); // texture id
+    sl_assert(f.size() < 4096);
+    unsigned short nrm   = faces_nrm_idx[fidx];
+    unsigned short tvc   = faces_tvc_idx[fidx];
+    unsigned short texid = 2 + texLevels() * miptex_to_tex[face_texids[fidx]];
+    unsigned short lmapid  = 0;
+    unsigned short lmap_uv = 0;
+    v3s            pref    = v3s(0,0,0);
     if (face_to_lmap.count(face_ids[fidx])) {
       const lmap_nfo& lmapnfo = face_to_lmap.at(face_ids[fidx]);
-      short lmapid = 2 + lmapnfo.pack->tex_id;
-      fwrite(&lmapid, sizeof(short), 1, pack); // lmap texture
+      lmapid = 2 + lmapnfo.pack->tex_id;
       sl_assert(lmapnfo.uv_pos[0] >= 0 && lmapnfo.uv_pos[0] < 256
             && lmapnfo.uv_pos[1] >= 0 && lmapnfo.uv_pos[1] < 256);
-      unsigned short lmap_uv = (lmapnfo.uv_pos[0] & 255) | ((lmapnfo.uv_pos[1] & 255) << 8);
-      fwrite(&lmap_uv, sizeof(unsigned short), 1, pack); // lmap uv
-      v3s pref = v3s(lmapnfo.pref * scale);
+      lmap_uv = (lmapnfo.uv_pos[0] & 255) | ((lmapnfo.uv_pos[1] & 255) << 8);
+      pref = v3s(lmapnfo.pref * scale);
       coord_swap(pref);
-      fwrite(&pref[0], sizeof(short), 1, pack);
-      fwrite(&pref[1], sizeof(short), 1, pack);
-      fwrite(&pref[2], sizeof(short), 1, pack);
     } else {
       /// TODO: store info for the no-lightmap case
-      short zeros[] = { 0,0,0,0,0 };
-      fwrite(&zeros, sizeof(short), 5, pack);
     }
-    start += f.size();
+    sl_assert(texid < 1024 && lmapid < 1024); // GPU texture ids are 10 bits
+    // plane distance, using the same fixed point normal as in the header
+    // => backface test in world space: plane_d - dot(view,normal) < 0
+    int plane_d = 0;
+    if (!f.empty()) {
+      v3i i_n = v3i(-_global_uniquen[nrm] * 256.0f);
+      coord_swap(i_n);
+      v3s iv  = ivs[f[0]];
+      plane_d = i_n[0] * (int)iv[0] + i_n[1] * (int)iv[1] + i_n[2] * (int)iv[2];
+    }
+    unsigned int rec[5];
+    rec[0] = (unsigned int)plane_d;
+    rec[1] = nrm | (tvc << 16);
+    rec[2] = texid | (lmapid << 10) | ((unsigned int)f.size() << 20);
+    rec[3] = lmap_uv | ((unsigned int)(unsigned short)pref[0] << 16);
+    rec[4] = (unsigned short)pref[1] | ((unsigned int)(unsigned short)pref[2] << 16);
+    bwrite(&rec[0], sizeof(unsigned int), 5, _lp.bytes);
     ++fidx;
   }
-  //    indices
+  //    indices, uint8 or uint16 (leaf_flag_idx16)
+  int idx_bytes = 0;
   for (const auto& f : ifaces) {
     for (const auto& i : f) {
-      fwrite(&i, sizeof(int), 1, pack);
+      if (wide) {
+        unsigned short i16 = (unsigned short)i;
+        bwrite(&i16, sizeof(unsigned short), 1, _lp.bytes);
+        idx_bytes += 2;
+      } else {
+        unsigned char  i8  = (unsigned char)i;
+        bwrite(&i8, sizeof(unsigned char), 1, _lp.bytes);
+        idx_bytes += 1;
+      }
     }
   }
-  // increment first visibility entry
-  _vis_first += vis_len;
+  while (idx_bytes & 3) { // pad to 4 bytes
+    unsigned char pad = 0;
+    bwrite(&pad, sizeof(unsigned char), 1, _lp.bytes);
+    ++idx_bytes;
+  }
 }
 
 // --------------------------------------------------------------
@@ -905,175 +1702,88 @@ void remap(int& _c) // c is a 6 bit color component
 
 // --------------------------------------------------------------
 
+// writes a texture table entry: address (24 bits), size byte (hp2,wp2)
+void writeTexEntry(FILE *pack, int addr, int wp2, int hp2)
+{
+  unsigned char b[8];
+  memset(b, 0, sizeof(b));
+  b[0] = addr & 255;
+  b[1] = (addr >> 8) & 255;
+  b[2] = (addr >> 16) & 255;
+  b[3] = wp2 | (hp2 << 4);
+  fwrite(b, 1, sizeof(b), pack);
+}
+
+// reserves the texture table, written by packTextures once all maps are in
+void reserveTextureTable(FILE *pack)
+{
+  sl_assert(ftell(pack) == 0);
+  vector<uchar> table(8 * max_textures, 0);
+  fwrite(&table[0], 1, table.size(), pack);
+}
+
+// appends the texture data and fills in the texture table
 void packTextures(FILE *pack)
 {
   /// produce data pack
   // get palette
   unsigned char pal[768];
   load_palette(SRC_PATH "palette.pal", pal);
-  // get texture header
-  fseek(f, h.miptex.offset, SEEK_SET);
-  long numtex;
-  fread(&numtex, sizeof(long), 1, f);
-  vector<long> offsets;
-  offsets.resize(numtex);
-  fread(&offsets[0], sizeof(long), numtex, f);
-  // 0-entry is all zeros
-  for (int i = 0; i < 8; ++i) {
-    unsigned char null = 0;
-    fwrite(&null, 1, 1, pack);
-  }
-  // give an id to lightmap packs
-  int lid = 0;
-  vector<lmap_pack*> lmapks;
-  for (auto pks : lmap_packs) {
-    for (auto pk : pks) {
-      pk->tex_id = numtex + (lid++);
-      lmapks.push_back(pk);
-    }
-  }
-  int numlmaps = lid;
-  // write texture table
-  int tex_addr = (2 << 20) /*2MB offset*/ + 8 * (2 + numtex + numlmaps); // first texture address
-  //                                            ^^ skip zero, one is full white for rendering lmaps only
-  // full white debug texture (16x16)
-  {
-    // write address
-    unsigned char b;
-    b = tex_addr & 255;
-    fwrite(&b, 1, 1, pack);
-    b = (tex_addr >> 8) & 255;
-    fwrite(&b, 1, 1, pack);
-    b = (tex_addr >> 16) & 255;
-    fwrite(&b, 1, 1, pack);
-    // size byte (hp2,wp2)
-    int wp2 = 4;
-    int hp2 = 4;
-    b = wp2 | (hp2 << 4);
-    fwrite(&b, 1, 1, pack);
-    b = 0;
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    // next
-    tex_addr += 16 * 16;
-  }
-  // game textures
-  for (int t = 0; t < numtex; ++t) {
-    // read nfo
-    miptex_t tnfo;
-    fseek(f, h.miptex.offset + offsets[t], SEEK_SET);
-    fread(&tnfo, sizeof(tnfo), 1, f);
-    if (tnfo.name[0] == '\0') {
-      // a strange entry in e1m2
-      tnfo.width = tnfo.height = 0;
-    }
-    // printf("%d, %s %dx%d\n", t, tnfo.name, tnfo.width, tnfo.height);
-    // write address
-    unsigned char b;
-    b = tex_addr & 255;
-    fwrite(&b, 1, 1, pack);
-    b = (tex_addr >> 8) & 255;
-    fwrite(&b, 1, 1, pack);
-    b = (tex_addr >> 16) & 255;
-    fwrite(&b, 1, 1, pack);
-    // size byte (hp2,wp2)
-    int wp2 = justHigherPow2(tnfo.width);
-    int hp2 = justHigherPow2(tnfo.height);
-    b = wp2 | (hp2 << 4);
-    fwrite(&b, 1, 1, pack);
-    b = 0;
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    // next
-    tex_addr += (1<< justHigherPow2(tnfo.width)) * (1 << justHigherPow2(tnfo.height));
-  }
-  // lightmap packs
-  for (auto pk : lmapks) {
-    // write address
-    unsigned char b;
-    b = tex_addr & 255;
-    fwrite(&b, 1, 1, pack);
-    b = (tex_addr >> 8) & 255;
-    fwrite(&b, 1, 1, pack);
-    b = (tex_addr >> 16) & 255;
-    fwrite(&b, 1, 1, pack);
-    // size byte (hp2,wp2)
-    int wp2 = justHigherPow2(pk->w);
-    int hp2 = justHigherPow2(pk->h);
-    b = wp2 | (hp2 << 4);
-    fwrite(&b, 1, 1, pack);
-    b = 0;
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    fwrite(&b, 1, 1, pack);
-    // next
-    tex_addr += pk->w * pk->h;
+  // texture ids: 0-entry is all zeros, one is full white for rendering
+  // lmaps only, then game textures (all their mip levels) and light map packs
+  int numtex  = (int)textures.size();
+  int nlevels = texLevels();
+  sl_assert(2 + numtex * nlevels + (int)pack_lmaps.size() <= max_textures);
+  for (int l = 0; l < (int)pack_lmaps.size(); ++l) {
+    sl_assert(pack_lmaps[l]->tex_id == numtex * nlevels + l); // see repackMap
   }
+  long data_start = ftell(pack);
+  int  tex_addr   = (2 << 20) /*2MB offset*/ + data_start; // first texture address
   // write data
   // -> white texture
   uchar white[16 * 16];
   memset(white, 254, 16*16);
   fwrite(&white[0], 1, sizeof(white), pack);
-  // -> game textures
-  for (int t = 0; t < numtex; ++t) {
-    // read nfo
-    miptex_t tnfo;
-    fseek(f, h.miptex.offset + offsets[t], SEEK_SET);
-    fread(&tnfo, sizeof(tnfo), 1, f);
-    if (tnfo.name[0] == '\0') {
-      // a strange entry in e1m2
-      continue;
-    }
-    // fprintf(stderr, "%d, %s %dx%d\n", t, tnfo.name, tnfo.width, tnfo.height);
-    // read pixels
-    vector<unsigned char> pixs;
-    pixs.resize(tnfo.width * tnfo.height);
-    fseek(f, h.miptex.offset + offsets[t] + tnfo.offset1, SEEK_SET);
-    fread(&pixs[0], 1, pixs.size(), f);
-#if 0
-    // add borders for debugging
-    for (int j = 0; j < tnfo.height; ++j) {
-      int i = 0;
-      pixs[i + j * tnfo.width] = 111;
-      i = tnfo.width - 1;
-      pixs[i + j * tnfo.width] = 244;
+  // -> game textures, levels of a texture are contiguous
+  for (const auto& tex : textures) {
+    if (!tex.pixels.empty()) {
+      fwrite(&tex.pixels[0], 1, tex.pixels.size(), pack);
     }
-#endif
-    // make padded version
-    vector<unsigned char> padded;
-    padded.resize((1 << justHigherPow2(tnfo.width)) * (1 << justHigherPow2(tnfo.height)));
-    for (int j = 0; j < (1 << justHigherPow2(tnfo.height)); ++j) {
-      for (int i = 0; i < (1 << justHigherPow2(tnfo.width)); ++i) {
-        padded[i + j * (1 << justHigherPow2(tnfo.width))] = pixs[(i% tnfo.width) + (j% tnfo.height) * tnfo.width];
+    for (int l = 1; l < nlevels; ++l) {
+      const auto& mip = tex.mips[l - 1];
+      if (!mip.empty()) {
+        fwrite(&mip[0], 1, mip.size(), pack);
       }
     }
-    // write
-    fwrite(&padded[0], 1, padded.size(), pack);
-#if 0
-    // save as image for visualization
-    t_image_nfo img;
-    img.depth = 24;
-    img.width = (1 << justHigherPow2(tnfo.width));
-    img.height = (1 << justHigherPow2(tnfo.height));
-    img.pixels = new uchar[(1 << justHigherPow2(tnfo.width)) * (1 << justHigherPow2(tnfo.height)) * 3 * sizeof(uchar)];
-    for (int i = 0; i < (1 << justHigherPow2(tnfo.width)) * (1 << justHigherPow2(tnfo.height)); ++i) {
-      img.pixels[i * 3 + 0] = pal[padded[i] * 3 + 0];
-      img.pixels[i * 3 + 1] = pal[padded[i] * 3 + 1];
-      img.pixels[i * 3 + 2] = pal[padded[i] * 3 + 2];
-    }
-    SaveTGAFile((std::string(SRC_PATH) + tnfo.name + ".tga").c_str(), &img);
-    delete[](img.pixels);
-#endif
   }
   // -> light maps
-  for (auto pk : lmapks) {
+  for (auto pk : pack_lmaps) {
     fwrite(pk->pixels, 1, pk->w*pk->h, pack);
   }
+  long data_end = ftell(pack);
+  sl_assert((2 << 20) + data_end <= (1 << 24)); // texture addresses are 24 bits
+  // write texture table
+  fseek(pack, 8 /*skip zero*/, SEEK_SET);
+  // full white debug texture (16x16)
+  writeTexEntry(pack, tex_addr, 4, 4);
+  tex_addr += 16 * 16;
+  // game textures
+  for (const auto& tex : textures) {
+    writeTexEntry(pack, tex_addr, tex.wp2, tex.hp2);
+    tex_addr += (int)tex.pixels.size();
+    for (int l = 1; l < nlevels; ++l) {
+      writeTexEntry(pack, tex_addr, max(tex.wp2 - l, 0), max(tex.hp2 - l, 0));
+      tex_addr += (int)tex.mips[l - 1].size();
+    }
+  }
+  // lightmap packs
+  for (auto pk : pack_lmaps) {
+    writeTexEntry(pack, tex_addr, justHigherPow2(pk->w), justHigherPow2(pk->h));
+    tex_addr += pk->w * pk->h;
+  }
+  fseek(pack, data_end, SEEK_SET);
+  printf("textures: %d game textures (%d levels), %d light map packs, %ld bytes\n",
+    numtex, nlevels, (int)pack_lmaps.size(), data_end - data_start);
   // write palette
   {
     FILE *fpal = fopen(SRC_PATH "/../../build/palette666.si", "w");
@@ -1094,7 +1804,8 @@ void packTextures(FILE *pack)
 
 // --------------------------------------------------------------
 
-void packBSP(FILE *pack,long &_offset_bsp_nodes,long &_offset_bsp_planes)
+// rewrites the BSP nodes and planes, see t_my_node/t_my_plane in q5k.c
+void packBSP(vector<uchar>& _nodes, vector<uchar>& _planes)
 {
   /// rewrite the BSP to be more compact and integer
   typedef struct {
@@ -1137,46 +1848,514 @@ void packBSP(FILE *pack,long &_offset_bsp_nodes,long &_offset_bsp_planes)
     planes.back().ny = nrm[1];
     planes.back().nz = nrm[2];
   }
-  // write bsp tree
-  _offset_bsp_nodes  = (2 << 20) /*2MB offset*/ + ftell(pack);
-  fwrite(&nodes[0], sizeof(t_my_node), nodes.size(), pack);
-  _offset_bsp_planes = (2 << 20) /*2MB offset*/ + ftell(pack);
-  fwrite(&planes[0], sizeof(t_my_plane), planes.size(), pack);
+  // bsp tree, as written in the pack
+  _nodes.clear();
+  bwrite(&nodes[0], sizeof(t_my_node), nodes.size(), _nodes);
+  _planes.clear();
+  bwrite(&planes[0], sizeof(t_my_plane), planes.size(), _planes);
 }
 
 // --------------------------------------------------------------
 
-int packVisList(FILE *pack)
+// reorders leaf records in the pack so that co-visible leaves are close
+// in flash, leaf ids are unchanged (see o_leaf_offsets)
+bool reorder_leaves = true;
+
+// interleaves the 10 low bits of x,y,z (Morton code)
+unsigned int morton3(unsigned int x, unsigned int y, unsigned int z)
+{
+  unsigned int m = 0;
+  for (int b = 0; b < 10; ++b) {
+    m |= ((x >> b) & 1) << (3 * b + 0);
+    m |= ((y >> b) & 1) << (3 * b + 1);
+    m |= ((z >> b) & 1) << (3 * b + 2);
+  }
+  return m;
+}
+
+// order in which leaves are stored, along a Z-order curve over leaf centers
+vector<int> leafOrder(int numleaves)
+{
+  vector<int> order(numleaves);
+  for (int l = 0; l < numleaves; ++l) { order[l] = l; }
+  if (!reorder_leaves) {
+    return order;
+  }
+  AAB<3> world;
+  vector<v3f> centers(numleaves);
+  for (int l = 0; l < numleaves; ++l) {
+    dleaf_t lf;
+    read(l, &lf);
+    centers[l] = v3f(
+      (lf.bound.min_x + lf.bound.max_x) * 0.5f,
+      (lf.bound.min_y + lf.bound.max_y) * 0.5f,
+      (lf.bound.min_z + lf.bound.max_z) * 0.5f);
+    world.addPoint(centers[l]);
+  }
+  v3f ext = world.maxCorner() - world.minCorner();
+  float sz = max(1.0f, tupleMax(ext));
+  vector<unsigned int> keys(numleaves);
+  for (int l = 0; l < numleaves; ++l) {
+    v3f c = (centers[l] - world.minCorner()) * (1023.0f / sz);
+    keys[l] = morton3((unsigned int)c[0], (unsigned int)c[1], (unsigned int)c[2]);
+  }
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+  return order;
+}
+
+// mean distance in bytes between the end of a leaf record and the start of
+// the next one, along each vislist (in the order the device reads them)
+float meanVislistSeek(const vector<vector<int> >& vislists,
+                      const vector<int>& order, const vector<int>& sizes)
+{
+  vector<long> start(order.size());
+  long at = 0;
+  for (int l : order) {
+    start[l] = at;
+    at      += sizes[l];
+  }
+  double sum = 0.0;
+  int    num = 0;
+  for (const auto& vis : vislists) {
+    if (vis.size() < 2) continue;
+    double seek = 0.0;
+    for (int i = 1; i < (int)vis.size(); ++i) {
+      seek += fabs((double)(start[vis[i]] - (start[vis[i - 1]] + sizes[vis[i - 1]])));
+    }
+    sum += seek / (double)(vis.size() - 1);
+    ++num;
+  }
+  return num > 0 ? (float)(sum / num) : 0.0f;
+}
+
+int packVisList(FILE *pack,const vector<vector<int> >& vislists)
 {
   int maxvis = 0;
   int totvis = 0;
   int numleaves = h.leaves.size / sizeof(dleaf_t);
   for (int l = 0; l < numleaves; ++l) {
-    vector<int> vis;
-    getLeafVislist(l, vis);
+    const vector<int>& vis = vislists[l];
     maxvis = max(maxvis, (int)vis.size());
     for (auto vl : vis) {
       unsigned short s = (unsigned short)vl;
-      fwrite(&vl, sizeof(unsigned short), 1, pack);
+      fwrite(&s, sizeof(unsigned short), 1, pack);
     }
     totvis += vis.size();
   }
   return maxvis;
 }
 
+// stores vislists in run-length form (see -vis-rle), as in the BSP but
+// over leaf ranks: bit r of the bitset is set when the leaf stored in
+// r-th position is visible, so that q5k reads leaves in flash order.
+// A non zero byte holds 8 bits, a zero byte is followed by the number
+// of zero bytes it stands for. Trailing zero bytes are dropped.
+bool vis_rle = false;
+
+vector<uchar> encodeVisRLE(const vector<int>& vis, const vector<int>& rank)
+{
+  vector<uchar> bits((rank.size() + 7) / 8, 0);
+  for (int l : vis) {
+    bits[rank[l] >> 3] |= 1 << (rank[l] & 7);
+  }
+  while (!bits.empty() && bits.back() == 0) {
+    bits.pop_back();
+  }
+  vector<uchar> rle;
+  int i = 0;
+  while (i < (int)bits.size()) {
+    if (bits[i] != 0) {
+      rle.push_back(bits[i++]);
+      continue;
+    }
+    int run = 0;
+    while (i < (int)bits.size() && bits[i] == 0 && run < 255) {
+      ++run; ++i;
+    }
+    rle.push_back(0);
+    rle.push_back((uchar)run);
+  }
+  return rle;
+}
+
 // --------------------------------------------------------------
 
-int main(int argc, const char **argv)
+// Face visibility (see -face-vis): for each leaf, which faces of the leaves
+// in its PVS may be seen from anywhere in the leaf. A face is first tested
+// against its plane from the corners of the leaf box, then rays are cast
+// from points sampled in the leaf to points sampled on the face, the face
+// is kept as soon as one ray does not cross a solid leaf. Sampling makes
+// this a close, not strict, superset of what the player can see.
+bool face_vis      = false;
+int  face_vis_grid = 4; // view samples per leaf box axis
+
+const int contents_solid = -2; // dleaf_t type
+
+// a face as seen by the ray tests
+typedef struct {
+  v3f         n;       // front normal
+  float       d;
+  vector<v3f> samples; // slightly in front of the face
+} vis_face;
+
+// true if segment [p,q] does not cross a solid leaf
+bool segmentClear(u_short nid, const v3f& p, const v3f& q)
 {
-  // open BSP file
-  fopen_s(&f, SRC_PATH "/../" MAP, "rb");
-  if (f == NULL) {
-    fprintf(stderr, "\n\n[error] cannot open the bsp file, please place "
-                    MAP " in the q5k directory.\n\n\n");
-    return -1;
+  if (nid & 0x8000) {
+    dleaf_t lf;
+    read((u_short)~nid, &lf);
+    return lf.type != contents_solid;
+  }
+  node_t nd;
+  read(nid, &nd);
+  plane_t pl;
+  read(nd.plane_id, &pl);
+  float dp = dot(p, to_v3f(pl.normal)) - pl.dist;
+  float dq = dot(q, to_v3f(pl.normal)) - pl.dist;
+  if (dp >= 0.0f && dq >= 0.0f) return segmentClear(nd.front, p, q);
+  if (dp <  0.0f && dq <  0.0f) return segmentClear(nd.back,  p, q);
+  // split, near side first
+  v3f m = p + (q - p) * (dp / (dp - dq));
+  if (dp >= 0.0f) {
+    return segmentClear(nd.front, p, m) && segmentClear(nd.back,  m, q);
+  } else {
+    return segmentClear(nd.back,  p, m) && segmentClear(nd.front, m, q);
+  }
+}
+
+// faces of a leaf, in leaf record order (see gatherLeaf)
+vector<vis_face> visFaces(int l)
+{
+  vector<vector<v3f> > faces;
+  vector<int>          face_ids;
+  getLeafFaces(l, faces, face_ids);
+  vector<vis_face> vfs(faces.size());
+  for (int f = 0; f < (int)faces.size(); ++f) {
+    face_t fc;
+    read(face_ids[f], &fc);
+    plane_t pl;
+    read(fc.plane_id, &pl);
+    float sgn = fc.side ? -1.0f : 1.0f;
+    vfs[f].n = to_v3f(pl.normal) * sgn;
+    vfs[f].d = pl.dist * sgn;
+    // centroid and vertices pulled towards it, one unit in front
+    v3f c(0.0f, 0.0f, 0.0f);
+    for (const auto& p : faces[f]) { c = c + p; }
+    c = c / (float)max(1, (int)faces[f].size());
+    vfs[f].samples.push_back(c + vfs[f].n);
+    for (const auto& p : faces[f]) {
+      vfs[f].samples.push_back(p + (c - p) * 0.1f + vfs[f].n);
+    }
+  }
+  return vfs;
+}
+
+// points sampled in a leaf (centers of a grid over its box, inside the leaf)
+vector<v3f> leafSamples(int l)
+{
+  dleaf_t lf;
+  read(l, &lf);
+  v3f mn(lf.bound.min_x, lf.bound.min_y, lf.bound.min_z);
+  v3f mx(lf.bound.max_x, lf.bound.max_y, lf.bound.max_z);
+  vector<v3f> pts;
+  int n = face_vis_grid;
+  for (int k = 0; k < n; ++k) {
+    for (int j = 0; j < n; ++j) {
+      for (int i = 0; i < n; ++i) {
+        v3f p(mn[0] + (mx[0] - mn[0]) * ((float)i + 0.5f) / (float)n,
+              mn[1] + (mx[1] - mn[1]) * ((float)j + 0.5f) / (float)n,
+              mn[2] + (mx[2] - mn[2]) * ((float)k + 0.5f) / (float)n);
+        if (locateLeaf(p, 0) == l) {
+          pts.push_back(p);
+        }
+      }
+    }
+  }
+  if (pts.empty()) {
+    pts.push_back((mn + mx) * 0.5f);
+  }
+  return pts;
+}
+
+// may face vf be seen from leaf l? (box corners, samples of l)
+bool faceVisible(const vis_face& vf, const v3f *corners, const vector<v3f>& pts)
+{
+  // backfacing from the whole leaf?
+  bool front = false;
+  for (int c = 0; c < 8; ++c) {
+    if (dot(corners[c], vf.n) - vf.d > 0.0f) { front = true; break; }
+  }
+  if (!front) return false;
+  // rays
+  for (const auto& q : vf.samples) {
+    for (const auto& p : pts) {
+      if (dot(p, vf.n) - vf.d > 0.0f && segmentClear(0, p, q)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// face masks of each leaf, one per entry of its vislist (in leaf id order,
+// as returned by getLeafVislist): bit f set if face f may be visible
+void computeFaceVis(const vector<vector<int> >& vis,
+                    vector<vector<vector<uchar> > >& _masks, vector<int>& _numfaces)
+{
+  int numleaves = (int)vis.size();
+  vector<vector<vis_face> > faces(numleaves);
+  vector<vector<v3f> >      samples(numleaves);
+  parallel_for(numleaves, [&](int l) {
+    faces[l]   = visFaces(l);
+    samples[l] = leafSamples(l);
+  });
+  _numfaces.resize(numleaves);
+  for (int l = 0; l < numleaves; ++l) {
+    _numfaces[l] = (int)faces[l].size();
+  }
+  _masks.assign(numleaves, vector<vector<uchar> >());
+  parallel_for(numleaves, [&](int l) {
+    dleaf_t lf;
+    read(l, &lf);
+    v3f corners[8];
+    for (int c = 0; c < 8; ++c) {
+      corners[c] = v3f((c & 1) ? lf.bound.max_x : lf.bound.min_x,
+                       (c & 2) ? lf.bound.max_y : lf.bound.min_y,
+                       (c & 4) ? lf.bound.max_z : lf.bound.min_z);
+    }
+    for (int t : vis[l]) {
+      const auto& tfs = faces[t];
+      vector<uchar> mask((tfs.size() + 7) / 8, 0);
+      for (int f = 0; f < (int)tfs.size(); ++f) {
+        if (faceVisible(tfs[f], corners, samples[l])) {
+          mask[f >> 3] |= 1 << (f & 7);
+        }
+      }
+      _masks[l].push_back(mask);
+    }
+  });
+}
+
+// face mask blocks, one per leaf, entries follow the vislist as written
+// (vislists sorted by rank). A block starts with the offset of each entry
+// mask from the block start, face_mask_all if all faces may be visible,
+// face_mask_none if none is (q5k then skips the leaf), then the masks.
+const int face_mask_none = 0;
+const int face_mask_all  = 0xffff;
+
+vector<uchar> faceMaskBlock(const vector<int>& vis_ids,    // leaf id order
+                            const vector<int>& vis_sorted, // as written
+                            const vector<vector<uchar> >& masks,
+                            const vector<int>& numfaces,
+                            int& _num_none, int& _num_all)
+{
+  vector<uchar> block(vis_sorted.size() * sizeof(unsigned short), 0);
+  for (int i = 0; i < (int)vis_sorted.size(); ++i) {
+    int e = (int)(lower_bound(vis_ids.begin(), vis_ids.end(), vis_sorted[i]) - vis_ids.begin());
+    sl_assert(e < (int)vis_ids.size() && vis_ids[e] == vis_sorted[i]);
+    const vector<uchar>& mask = masks[e];
+    int nf    = numfaces[vis_sorted[i]];
+    int nvis  = 0;
+    for (int f = 0; f < nf; ++f) {
+      nvis += (mask[f >> 3] >> (f & 7)) & 1;
+    }
+    unsigned short offs;
+    if (nvis == 0) {
+      offs = face_mask_none; ++_num_none;
+    } else if (nvis == nf) {
+      offs = face_mask_all;  ++_num_all;
+    } else {
+      sl_assert(block.size() < face_mask_all);
+      offs = (unsigned short)block.size();
+      block.insert(block.end(), mask.begin(), mask.end());
+    }
+    memcpy(&block[i * sizeof(unsigned short)], &offs, sizeof(unsigned short));
   }
+  return block;
+}
+
+// --------------------------------------------------------------
+
+// start position, from the first info_player_start entity
+bool playerStart(v3f& _pos)
+{
+  string ents(bsp.at<char>(h.entities.offset, h.entities.size), h.entities.size);
+  size_t cls = ents.find("\"info_player_start\"");
+  if (cls == string::npos) return false;
+  size_t beg = ents.rfind('{', cls);
+  size_t end = ents.find('}', cls);
+  if (beg == string::npos || end == string::npos) return false;
+  size_t org = ents.find("\"origin\"", beg);
+  if (org == string::npos || org > end) return false;
+  float x, y, z;
+  if (sscanf(ents.c_str() + org + 8, " \"%f %f %f\"", &x, &y, &z) != 3) return false;
+  _pos = v3f(x, y, z);
+  return true;
+}
+
+// --------------------------------------------------------------
+
+// stage outputs, as stored in the cache
+
+vector<uchar> saveLightMaps()
+{
+  vector<uchar> bytes;
+  bput(bytes, numlightmaps);
+  bput(bytes, (int)lmap_packs.size());
+  map<const lmap_pack*, int> pack_ids;
+  for (auto pk : lmap_packs) {
+    int id = (int)pack_ids.size();
+    pack_ids[pk] = id;
+    bput(bytes, pk->w);
+    bput(bytes, pk->h);
+    bput(bytes, vector<uchar>(pk->pixels, pk->pixels + pk->w * pk->h));
+  }
+  bput(bytes, (int)face_to_lmap.size());
+  for (const auto& fl : face_to_lmap) {
+    bput(bytes, fl.first);
+    bput(bytes, pack_ids.at(fl.second.pack));
+    bput(bytes, fl.second.uv_pos);
+    bput(bytes, fl.second.pref);
+  }
+  return bytes;
+}
+
+void loadLightMaps(const vector<uchar>& bytes)
+{
+  bstream bs = { &bytes, 0 };
+  bget(bs, numlightmaps);
+  int num_packs;
+  bget(bs, num_packs);
+  for (int p = 0; p < num_packs; ++p) {
+    int w, h;
+    bget(bs, w);
+    bget(bs, h);
+    vector<uchar> pixs;
+    bget(bs, pixs);
+    sl_assert(h <= w && (int)pixs.size() == w * h);
+    lmap_pack *pk = lmap_pack_pre(w);
+    pk->h = h;
+    memcpy(pk->pixels, &pixs[0], pixs.size());
+    lmap_packs.push_back(pk);
+  }
+  int num_faces;
+  bget(bs, num_faces);
+  for (int f = 0; f < num_faces; ++f) {
+    int fid, pack_id;
+    lmap_nfo nfo;
+    bget(bs, fid);
+    bget(bs, pack_id);
+    bget(bs, nfo.uv_pos);
+    bget(bs, nfo.pref);
+    nfo.pack = lmap_packs.at(pack_id);
+    face_to_lmap[fid] = nfo;
+  }
+}
+
+vector<uchar> saveLeaves(const vector<leaf_payload>& leaves,
+  const vector<v3f>& global_uniquen, const vector<pair<v4f, v4f> >& global_uniques)
+{
+  vector<uchar> bytes;
+  bput(bytes, max_verts);
+  bput(bytes, global_uniquen);
+  bput(bytes, global_uniques);
+  for (const auto& lp : leaves) {
+    bput(bytes, lp.bytes);
+    bput(bytes, lp.vis);
+  }
+  return bytes;
+}
+
+void loadLeaves(const vector<uchar>& bytes, vector<leaf_payload>& _leaves,
+  vector<v3f>& _global_uniquen, vector<pair<v4f, v4f> >& _global_uniques)
+{
+  bstream bs = { &bytes, 0 };
+  bget(bs, max_verts);
+  bget(bs, _global_uniquen);
+  bget(bs, _global_uniques);
+  for (auto& lp : _leaves) {
+    bget(bs, lp.bytes);
+    bget(bs, lp.vis);
+  }
+}
+
+// --------------------------------------------------------------
+
+// The pack manifest, read by q5k at boot, replaces the generated header.
+// It follows the texture data, its address is written in bytes 4..7 of
+// the first texture table entry (unused by the GPU, see packManifest):
+//   pack_manifest, then the address of each map_manifest
+//   map_manifest,  then normals (3 shorts, padded to 4 bytes), texvecs
+// Mirrors t_pack_manifest and t_map_manifest in q5k.c
+
+const int pack_magic   = 0x504b3551; // 'Q5KP'
+const int pack_version = 4;
+
+const int map_flag_vis_rle = 1; // vislists in run-length form, see encodeVisRLE
+const int map_flag_mips    = 2; // game textures have their mip levels, see texLevels
+const int map_flag_faces   = 4; // per leaf face masks, see computeFaceVis
+const int map_flag_gids    = 8; // leaves carry global vertex ids, see packLeaf
+
+const int arena_budget   = 14 * 1024; // bytes, must match ARENA_SIZE in q5k.c
+const int vtx_cache_size = 128;       // slots per core, must match VTX_CACHE_SIZE in q5k.c
+
+typedef struct {
+  int magic;
+  int version;
+  int stamp;    // hash of the pack content, q5k reloads when it changes
+  int num_maps;
+} pack_manifest;
+
+typedef struct {
+  int   leaf_format;
+  int   flags;
+  int   o_bsp_nodes;
+  int   o_bsp_planes;
+  int   o_vislist;
+  int   o_leaf_offsets;
+  int   o_vis_offsets;   // leaf offsets as indexed by vislist entries
+  int   n_max_vislen;
+  int   n_max_vis_bytes; // max run-length vislist size, in bytes
+  int   n_max_verts;
+  int   n_max_leaf_size;
+  int   n_normals;
+  int   n_texvecs;
+  int   mip_dist;        // plane distance where a texel covers a pixel
+  int   o_face_masks;    // face mask (start, length) by leaf id
+  int   n_max_mask_bytes;
+  short view[3];
+  short pad;
+} map_manifest;
+
+// a map to repack
+typedef struct {
+  string bsp;        // input file
+  bool   has_start;  // start position given on the command line
+  v3f    start;
+  vector<int>   miptex_to_tex;
+  // produced by repackMap
+  map_manifest  mfst;
+  vector<short> normals;
+  vector<short> texvecs;
+} map_job;
+
+// repacks the map opened in bsp, appends its data to the pack and
+// fills in its manifest
+void repackMap(FILE *pack, map_job& job)
+{
   // read header
-  fread(&h, sizeof(h), 1, f);
+  h = *bsp.at<dheader_t>(0);
+  // visibility lists
+  vlist = bsp.at<uchar>(h.visilist.offset, h.visilist.size);
+  // textures, see gatherTextures
+  miptex_to_tex = job.miptex_to_tex;
+  // reset per map globals
+  face_to_lmap.clear();
+  lmap_srcs.clear();
+  lmap_packs.clear();
+  face_usage.clear();
+  numlightmaps = 0;
+  max_verts    = 0;
   // some info
   fprintf(stderr, "version:\t%04x\n",h.version);
   fprintf(stderr, "entities:\t@%04x %6d bytes\n", h.entities.offset,h.entities.size);
@@ -1203,110 +2382,497 @@ int main(int argc, const char **argv)
   fprintf(stderr, "model 0: origin %f %f %f\n", m.origin.x,m.origin.y,m.origin.z);
   fprintf(stderr, "model 0: node_id0 %d\n", m.node_id0);
   // ----------------------------------------------------------------
-  // produce data pack
-  // ----------------------------------------------------------------
-  FILE *pack = fopen(SRC_PATH "/../../build/quake.img", "wb");
-  sl_assert(pack != NULL);
-  ofstream hd(SRC_PATH "/../q.h");
+  int numleaves = h.leaves.size / sizeof(dleaf_t);
+  vector<leaf_payload> leaves(numleaves);
+  bool gathered = false;
+  // gathers leaves, in parallel, once and only if a stage is not cached
+  auto gather = [&]() {
+    if (gathered) return;
+    stage_clock tm = stageStart();
+    parallel_for(numleaves, [&](int l) { gatherLeaf(l, leaves[l]); });
+    stageEnd("gather", tm, false);
+    gathered = true;
+  };
+  // lumps read by gatherLeaf
+  uint64_t geom_key = keyLumps(0, { &h.faces, &h.texinfo, &h.ledges, &h.edges,
+                                    &h.vertices, &h.lface, &h.leaves, &h.visilist });
+  vector<uchar> bytes;
   // ----------------------------------------------------------------
   /// produce light maps
-  int numleaves = h.leaves.size / sizeof(dleaf_t);
-  for (int p2 = 0; p2 <= 5; p2++) {
-    lmap_packs.push_back(vector<lmap_pack*>());
+  uint64_t lmap_key = keyAdd(keyAdd(keyAdd(geom_key, cache_version_lightmaps), lmap_atlas_size), lmap_padding);
+  lmap_key = keyLumps(lmap_key, { &h.lightmaps });
+  bool cached = cacheLoad("lightmaps", lmap_key, bytes);
+  if (!cached) {
+    gather();
   }
-  for (int l = 0; l < numleaves; ++l) {
-    extractLightMaps(l);
-  }
-  printf("num lightmaps: %d\n", numlightmaps);
-  int p = 0;
-  for (int p2 = 0; p2 < lmap_packs.size(); ++p2) {
-    for (auto pk : lmap_packs[p2]) {
-      while (!lmap_pack_pad(pk)) { } // diffuse
-      // lmap_pack_save(pk, sprint("lmaps\\pack%02d_%02d.tga", p2, p++));
+  stage_clock tm = stageStart();
+  if (cached) {
+    loadLightMaps(bytes);
+  } else {
+    for (int l = 0; l < numleaves; ++l) {
+      extractLightMaps(l, leaves[l].faces, leaves[l].face_ids);
     }
+    printf("num lightmaps: %d\n", numlightmaps);
+    packLightMaps();
+    int p = 0;
+    for (auto pk : lmap_packs) {
+      lmap_pack_pad(pk); // diffuse
+      // lmap_pack_save(pk, sprint("lmaps\\pack%02d.tga", p++));
+    }
+    cacheStore("lightmaps", lmap_key, saveLightMaps());
+  }
+  stageEnd("lightmaps", tm, cached);
+  // give an id to lightmap packs, after the game textures of all maps
+  int first_lmap_id = (int)textures.size() * texLevels() + (int)pack_lmaps.size();
+  for (auto pk : lmap_packs) {
+    pk->tex_id = (int)textures.size() * texLevels() + (int)pack_lmaps.size();
+    pack_lmaps.push_back(pk);
   }
-  // ----------------------------------------------------------------
-  /// pack all textures
-  packTextures(pack);
   // ----------------------------------------------------------------
   /// pack BSP tree
-  long offset_bsp_nodes, offset_bsp_planes;
-  packBSP(pack, offset_bsp_nodes, offset_bsp_planes);
+  tm = stageStart();
+  uint64_t bsp_key = keyLumps(keyAdd(keyAdd(0, cache_version_bsp), scale), { &h.nodes, &h.planes });
+  vector<uchar> bsp_nodes, bsp_planes;
+  cached = cacheLoad("bsp", bsp_key, bytes);
+  if (cached) {
+    bstream bs = { &bytes, 0 };
+    bget(bs, bsp_nodes);
+    bget(bs, bsp_planes);
+  } else {
+    packBSP(bsp_nodes, bsp_planes);
+    bytes.clear();
+    bput(bytes, bsp_nodes);
+    bput(bytes, bsp_planes);
+    cacheStore("bsp", bsp_key, bytes);
+  }
+  long offset_bsp_nodes  = (2 << 20) /*2MB offset*/ + ftell(pack);
+  fwrite(&bsp_nodes[0], 1, bsp_nodes.size(), pack);
+  long offset_bsp_planes = (2 << 20) /*2MB offset*/ + ftell(pack);
+  fwrite(&bsp_planes[0], 1, bsp_planes.size(), pack);
+  stageEnd("bsp", tm, cached);
   // ----------------------------------------------------------------
   /// pack leaves
-  vector<int>  leaf_offsets;
   vector<v3f>  global_uniquen;
   vector<pair<v4f, v4f> > global_uniques;
-  int vis_first = 0;
-  for (int l = 0; l < numleaves; ++l) {
-    leaf_offsets.push_back((2 << 20) /*2MB offset*/ + ftell(pack) );
-    packLeaf(pack, l, global_uniquen, global_uniques, vis_first);
+  uint64_t leaves_key = keyAdd(keyAdd(keyAdd(keyAdd(lmap_key, cache_version_leaves), scale), leaf_format), pack_vertex_deltas);
+  leaves_key = keyAdd(keyAdd(keyAdd(leaves_key, first_lmap_id), texLevels()), pack_vertex_ids);
+  leaves_key = fnv1a(&miptex_to_tex[0], miptex_to_tex.size() * sizeof(int), leaves_key);
+  cached = cacheLoad("leaves", leaves_key, bytes);
+  if (!cached) {
+    gather();
+  }
+  tm = stageStart();
+  if (cached) {
+    loadLeaves(bytes, leaves, global_uniquen, global_uniques);
+  } else {
+    spatial_hash<3> global_uniquen_hash(normal_cell);
+    spatial_hash<2> global_uniques_hash(surface_tol);
+    unordered_map<uint64_t, int> global_vtx;
+    int vis_first = 0;
+    // -> resolve global ids, serially in leaf order
+    for (int l = 0; l < numleaves; ++l) {
+      resolveLeaf(leaves[l], global_uniquen, global_uniquen_hash, global_uniques, global_uniques_hash, global_vtx, vis_first);
+    }
+    printf("leaves: %d global vertices\n", (int)global_vtx.size());
+    // -> produce leaf records, in parallel
+    parallel_for(numleaves, [&](int l) { packLeaf(l, leaves[l], global_uniquen); });
+    cacheStore("leaves", leaves_key, saveLeaves(leaves, global_uniquen, global_uniques));
+  }
+  stageEnd("leaves", tm, cached);
+  // ----------------------------------------------------------------
+  /// face visibility
+  vector<vector<vector<uchar> > > face_masks;
+  vector<int>                     face_counts;
+  if (face_vis) {
+    tm = stageStart();
+    uint64_t fvis_key = keyAdd(keyAdd(0, cache_version_facevis), face_vis_grid);
+    fvis_key = keyLumps(fvis_key, { &h.nodes, &h.planes, &h.leaves, &h.lface, &h.faces,
+                                    &h.edges, &h.ledges, &h.vertices, &h.texinfo, &h.miptex, &h.visilist });
+    cached = cacheLoad("facevis", fvis_key, bytes);
+    if (cached) {
+      bstream bs = { &bytes, 0 };
+      bget(bs, face_counts);
+      face_masks.resize(numleaves);
+      for (auto& lm : face_masks) {
+        int n;
+        bget(bs, n);
+        lm.resize(n);
+        for (auto& m : lm) { bget(bs, m); }
+      }
+    } else {
+      vector<vector<int> > vis(numleaves);
+      for (int l = 0; l < numleaves; ++l) { vis[l] = leaves[l].vis; }
+      computeFaceVis(vis, face_masks, face_counts);
+      bytes.clear();
+      bput(bytes, face_counts);
+      for (const auto& lm : face_masks) {
+        bput(bytes, (int)lm.size());
+        for (const auto& m : lm) { bput(bytes, m); }
+      }
+      cacheStore("facevis", fvis_key, bytes);
+    }
+    stageEnd("facevis", tm, cached);
   }
-  // add one more to tag end
-  leaf_offsets.push_back((2 << 20) /*2MB offset*/ + ftell(pack));
-  /// store leaf offsets
+  tm = stageStart();
+  // -> write, along a locality preserving order
+  vector<int> order = leafOrder(numleaves);
+  vector<int> rank(numleaves);
+  for (int i = 0; i < numleaves; ++i) { rank[order[i]] = i; }
+  // -> run-length vislists, leaf records point to them (start, length in bytes)
+  vector<uchar> vis_rle_bytes;
+  int max_vis_bytes = 0;
+  if (vis_rle) {
+    int plain_bytes = 0;
+    for (int l = 0; l < numleaves; ++l) {
+      vector<uchar> rle = encodeVisRLE(leaves[l].vis, rank);
+      int start = (int)vis_rle_bytes.size();
+      int len   = (int)rle.size();
+      memcpy(&leaves[l].bytes[6 * sizeof(short)], &start, sizeof(int));
+      memcpy(&leaves[l].bytes[6 * sizeof(short) + sizeof(int)], &len, sizeof(int));
+      vis_rle_bytes.insert(vis_rle_bytes.end(), rle.begin(), rle.end());
+      max_vis_bytes = max(max_vis_bytes, len);
+      plain_bytes  += (int)leaves[l].vis.size() * (int)sizeof(unsigned short);
+    }
+    printf("vislists: %d bytes run-length (%d in BSP), %d bytes expanded, ratio %.1fx\n",
+      (int)vis_rle_bytes.size(), h.visilist.size, plain_bytes,
+      vis_rle_bytes.empty() ? 0.0f : (float)plain_bytes / (float)vis_rle_bytes.size());
+  }
+  vector<int> leaf_starts(numleaves), leaf_sizes(numleaves);
+  for (int l : order) {
+    leaf_starts[l] = (2 << 20) /*2MB offset*/ + ftell(pack);
+    leaf_sizes[l]  = (int)leaves[l].bytes.size();
+    fwrite(&leaves[l].bytes[0], 1, leaves[l].bytes.size(), pack);
+  }
+  /// store leaf offsets, with sizes since leaves are not in index order
   long offset_leaf_offsets = (2 << 20) /*2MB offset*/ + ftell(pack);
-  fwrite(&leaf_offsets[0], sizeof(int), leaf_offsets.size(), pack);
+  for (int l = 0; l < numleaves; ++l) {
+    fwrite(&leaf_starts[l], sizeof(int), 1, pack);
+    fwrite(&leaf_sizes[l],  sizeof(int), 1, pack);
+  }
+  /// with run-length vislists, the entries are ranks: offsets in flash order
+  long offset_vis_offsets = offset_leaf_offsets;
+  if (vis_rle) {
+    offset_vis_offsets = (2 << 20) /*2MB offset*/ + ftell(pack);
+    for (int l : order) {
+      fwrite(&leaf_starts[l], sizeof(int), 1, pack);
+      fwrite(&leaf_sizes[l],  sizeof(int), 1, pack);
+    }
+  }
   // max leaf size
   int max_leaf_size = 0;
-  for (int i = 0; i < (int)leaf_offsets.size()-1; ++i) {
-    max_leaf_size = max(max_leaf_size, leaf_offsets[i+1]- leaf_offsets[i]);
+  for (int l = 0; l < numleaves; ++l) {
+    max_leaf_size = max(max_leaf_size, leaf_sizes[l]);
   }
+  // vislists, sorted by position in flash
+  vector<vector<int> > vislists(numleaves);
+  vector<int> id_order(numleaves);
+  for (int l = 0; l < numleaves; ++l) {
+    vislists[l] = leaves[l].vis;
+    id_order[l] = l;
+  }
+  float seek_before = meanVislistSeek(vislists, id_order, leaf_sizes);
+  for (auto& vis : vislists) {
+    stable_sort(vis.begin(), vis.end(), [&](int a, int b) { return rank[a] < rank[b]; });
+  }
+  float seek_after  = meanVislistSeek(vislists, order, leaf_sizes);
+  printf("mean flash seek per vislist: %.0f bytes (index order), %.0f bytes (%s)\n",
+    seek_before, seek_after, reorder_leaves ? "reordered" : "not reordered");
   // ----------------------------------------------------------------
   /// pack visibility list
   long offset_vislist = (2 << 20) /*2MB offset*/ + ftell(pack);
-  int maxvis_len = packVisList(pack);
-  // ----------------------------------------------------------------
-  fclose(pack);
+  int maxvis_len = 0;
+  if (vis_rle) {
+    fwrite(&vis_rle_bytes[0], 1, vis_rle_bytes.size(), pack);
+    for (const auto& vis : vislists) {
+      maxvis_len = max(maxvis_len, (int)vis.size());
+    }
+  } else {
+    maxvis_len = packVisList(pack, vislists);
+  }
+  /// face masks, one block per leaf and a table of (start, length) by leaf id
+  long offset_face_masks = 0;
+  int  max_mask_bytes    = 0;
+  if (face_vis) {
+    vector<int> mask_starts(numleaves), mask_sizes(numleaves);
+    int num_none = 0, num_all = 0, num_entries = 0, num_bytes = 0;
+    for (int l = 0; l < numleaves; ++l) {
+      vector<uchar> block = faceMaskBlock(leaves[l].vis, vislists[l], face_masks[l], face_counts, num_none, num_all);
+      mask_starts[l] = (2 << 20) /*2MB offset*/ + ftell(pack);
+      mask_sizes[l]  = (int)block.size();
+      if (!block.empty()) {
+        fwrite(&block[0], 1, block.size(), pack);
+      }
+      max_mask_bytes = max(max_mask_bytes, mask_sizes[l]);
+      num_entries   += (int)vislists[l].size();
+      num_bytes     += mask_sizes[l];
+    }
+    offset_face_masks = (2 << 20) /*2MB offset*/ + ftell(pack);
+    for (int l = 0; l < numleaves; ++l) {
+      fwrite(&mask_starts[l], sizeof(int), 1, pack);
+      fwrite(&mask_sizes[l],  sizeof(int), 1, pack);
+    }
+    printf("face masks: %d vislist entries, %d without visible faces, %d with all faces, %d bytes\n",
+      num_entries, num_none, num_all, num_bytes);
+  }
+  stageEnd("write", tm, false);
   // ----------------------------------------------------------------
-  /// write normals and texturing vectors in header
-  // normals
-  hd << "#define n_normals " << global_uniquen.size() << "\n";
-  hd << "p3d normals[] = {\n";
+  /// normals and texturing vectors, as in the manifest
+  job.normals.clear();
   for (auto nrm : global_uniquen) {
     v3i i_n = v3i(-nrm * 256.0f);
     coord_swap(i_n);
-    hd << '{'
-      << i_n[0] << ',' << i_n[1] << ',' << i_n[2] << ','
-      << "},\n";
-  }
-  hd << "};\n";
-  // texturing vectors
-  hd << "typedef struct { p3d vecS; short distS; p3d vecT; short distT; } t_texvecs;\n";
-  hd << "#define n_texvecs " << global_uniques.size() << "\n";
-  hd << "t_texvecs texvecs[] = {\n";
+    for (int c = 0; c < 3; ++c) { job.normals.push_back((short)i_n[c]); }
+  }
+  if (job.normals.size() & 1) { job.normals.push_back(0); } // pad to 4 bytes
+  job.texvecs.clear();
   for (auto srf : global_uniques) {
     v3i i_s = v3i(v3f(srf.first) * 256.0f);
     coord_swap(i_s);
     v3i i_t = v3i(v3f(srf.second) * 256.0f);
     coord_swap(i_t);
-    hd << '{'
-      << '{' << i_s[0] << ',' << i_s[1] << ',' << i_s[2] << "}," << (short)(srf.first[3]  * scale) << ','
-      << '{' << i_t[0] << ',' << i_t[1] << ',' << i_t[2] << "}," << (short)(srf.second[3] * scale) << ','
-      << "},\n";
-  }
-  hd << "};\n";
-  /// write offsets in header
-  hd << "#define o_bsp_nodes    " << offset_bsp_nodes  << '\n';
-  hd << "#define o_bsp_planes   " << offset_bsp_planes << '\n';
-  hd << "#define o_vislist      " << offset_vislist << '\n';
-  hd << "#define o_leaf_offsets " << offset_leaf_offsets << '\n';
-  /// write start viewpos in header
-  v3i pview = v3i(scale * view_pos);
+    for (int c = 0; c < 3; ++c) { job.texvecs.push_back((short)i_s[c]); }
+    job.texvecs.push_back((short)(srf.first[3]  * scale));
+    for (int c = 0; c < 3; ++c) { job.texvecs.push_back((short)i_t[c]); }
+    job.texvecs.push_back((short)(srf.second[3] * scale));
+  }
+  /// start view
+  v3f start = job.start;
+  if (!job.has_start && !playerStart(start)) {
+    fprintf(stderr, "[warning] no info_player_start in %s, starting at the origin\n", job.bsp.c_str());
+  }
+  v3i pview = v3i(scale * start);
   coord_swap(pview);
-  hd << "p3d view = {"
-    << pview[0] << ',' << pview[1] << ',' << pview[2]
-    << "};\n";
-  /// write max vis list length
-  hd << "#define n_max_vislen " << maxvis_len << '\n';
-  hd << "#define n_max_verts " << max_verts << '\n';
-  hd << "#define n_max_leaf_size " << max_leaf_size << '\n';
-  /// write additional definitions in header
-  hd << "typedef struct { unsigned short plane_id; unsigned short front; unsigned short back; aabb box; } t_my_node;\n";
-  hd << "typedef struct { short nx, ny, nz; int dist; } t_my_plane;\n";
+  /// manifest
+  map_manifest& mf   = job.mfst;
+  memset(&mf, 0, sizeof(map_manifest));
+  mf.leaf_format     = leaf_format;
+  mf.flags           = (vis_rle ? map_flag_vis_rle : 0) | (pack_mips ? map_flag_mips : 0)
+                     | (face_vis ? map_flag_faces : 0) | (pack_vertex_ids ? map_flag_gids : 0);
+  mf.o_bsp_nodes     = (int)offset_bsp_nodes;
+  mf.o_bsp_planes    = (int)offset_bsp_planes;
+  mf.o_vislist       = (int)offset_vislist;
+  mf.o_leaf_offsets  = (int)offset_leaf_offsets;
+  mf.o_vis_offsets   = (int)offset_vis_offsets;
+  mf.n_max_vislen    = maxvis_len;
+  mf.n_max_vis_bytes = max_vis_bytes;
+  mf.n_max_verts     = max_verts;
+  mf.n_max_leaf_size = max_leaf_size;
+  mf.n_normals       = (int)global_uniquen.size();
+  mf.n_texvecs       = (int)global_uniques.size();
+  mf.mip_dist        = (int)(256.0f * scale); // projection is x*256/z, texels are scaled Quake units
+  mf.o_face_masks    = (int)offset_face_masks;
+  mf.n_max_mask_bytes = max_mask_bytes;
+  for (int c = 0; c < 3; ++c) { mf.view[c] = (short)pview[c]; }
+  printf("manifest: %d normals, %d texvecs, max vislist %d, max verts %d, max leaf %d bytes\n",
+    mf.n_normals, mf.n_texvecs, mf.n_max_vislen, mf.n_max_verts, mf.n_max_leaf_size);
+}
+
+// --------------------------------------------------------------
+
+// bytes a map takes from the q5k arena, mirrors arena_layout in q5k.c
+int arenaBytes(const map_manifest& mf)
+{
+  auto align4 = [](int b) { return (b + 3) & ~3; };
+  bool rle   = (mf.flags & map_flag_vis_rle) != 0;
+  bool fcs   = (mf.flags & map_flag_faces)   != 0;
+  bool gids  = (mf.flags & map_flag_gids)    != 0;
+  int  half  = 4 + (mf.n_max_leaf_size >> 2);                 // ints, one leaf per core
+  int  bbox  = rle ? 0 : align4(mf.n_max_vislen * 12) >> 2;   // ints, aabb is 6 shorts
+  int  bytes = 0;
+  bytes += 2 * align4(mf.n_normals * 6) + align4(mf.n_normals * 4); // normals, transformed, dots
+  bytes += 2 * align4(mf.n_texvecs * 16);                           // texvecs, transformed
+  bytes += 2 * align4(mf.n_max_verts * 4);                          // projected vertices, per core
+  bytes += align4(mf.n_max_vislen * 2 + 4);                         // vislist
+  bytes += rle ? align4(mf.n_max_vis_bytes + 4) : 0;
+  bytes += rle && fcs ? align4(mf.n_max_vislen * 2) : 0;
+  bytes += fcs ? align4(mf.n_max_mask_bytes + 4) : 0;
+  bytes += gids ? align4(2 * vtx_cache_size * 14) : 0;              // vertex caches, 14 bytes a slot
+  bytes += max(half << 1, bbox) * 4;                                // memchunk
+  return bytes;
+}
+
+// --------------------------------------------------------------
+
+// appends the manifests and writes the locator, once all else is packed
+void packManifest(FILE *pack, const vector<map_job>& jobs)
+{
+  // the largest map has to fit the arena
+  int arena_max = 0;
+  for (const auto& job : jobs) {
+    arena_max = max(arena_max, arenaBytes(job.mfst));
+  }
+  printf("arena: largest map takes %d of %d bytes\n", arena_max, arena_budget);
+  sl_assert(arena_max <= arena_budget);
+  // map manifests
+  vector<int> map_addrs;
+  for (const auto& job : jobs) {
+    map_addrs.push_back((2 << 20) /*2MB offset*/ + ftell(pack));
+    fwrite(&job.mfst, sizeof(map_manifest), 1, pack);
+    if (!job.normals.empty()) {
+      fwrite(&job.normals[0], sizeof(short), job.normals.size(), pack);
+    }
+    if (!job.texvecs.empty()) {
+      fwrite(&job.texvecs[0], sizeof(short), job.texvecs.size(), pack);
+    }
+  }
+  // stamp, hash of everything written so far
+  long end = ftell(pack);
+  vector<uchar> all(end);
+  fseek(pack, 0, SEEK_SET);
+  sl_assert(fread(&all[0], 1, end, pack) == (size_t)end);
+  fseek(pack, end, SEEK_SET);
+  // pack manifest
+  pack_manifest pm;
+  pm.magic    = pack_magic;
+  pm.version  = pack_version;
+  pm.stamp    = (int)fnv1a(&all[0], all.size());
+  pm.num_maps = (int)jobs.size();
+  int addr    = (2 << 20) /*2MB offset*/ + (int)end;
+  fwrite(&pm, sizeof(pack_manifest), 1, pack);
+  fwrite(&map_addrs[0], sizeof(int), map_addrs.size(), pack);
+  // locator, in the unused bytes of texture table entry 0
+  fseek(pack, 4, SEEK_SET);
+  fwrite(&addr, sizeof(int), 1, pack);
+  fseek(pack, 0, SEEK_END);
+  printf("manifest: %d map(s), stamp %08x\n", pm.num_maps, (unsigned int)pm.stamp);
+}
+
+// --------------------------------------------------------------
+
+void usage()
+{
+  fprintf(stderr,
+    "usage: qrepack [options] [map.bsp ...]\n"
+    "  repacks one or more maps in a single data pack, game textures are shared\n"
+    "  and q5k reads the maps from the pack manifest\n"
+    "  options:\n"
+    "    -o <file>      output pack (default build/quake.img)\n"
+    "    -start x,y,z   start position in the first map, Quake units\n"
+    "                   (default info_player_start, " MAP " if no map is given)\n"
+    "    -scale s       global scale (default 4)\n"
+    "    -threads n     number of worker threads (default all cores)\n"
+    "    -no-reorder    store leaves in index order\n"
+    "    -no-deltas     store leaf vertices as raw shorts\n"
+    "    -no-vertex-ids store leaf vertices without their global ids\n"
+    "    -vis-rle       keep vislists in run-length form, decoded by q5k\n"
+    "    -no-mips       pack only the first mip level of game textures\n"
+    "    -face-vis [n]  per leaf masks of the faces visible from the leaf, n view\n"
+    "                   samples per leaf box axis (default 4), slow but cached\n"
+    "    -cache <dir>   stage cache directory (default qrepack/cache)\n"
+    "    -no-cache      rebuild all stages, without reading or writing the cache\n");
+}
+
+// --------------------------------------------------------------
+
+int main(int argc, const char **argv)
+{
+  // parse command line
+  string out_pack   = SRC_PATH "/../../build/quake.img";
+  bool   has_start  = false;
+  vector<map_job> jobs;
+  for (int a = 1; a < argc; ++a) {
+    string arg  = argv[a];
+    bool   more = a + 1 < argc;
+    if (arg == "-o" && more) {
+      out_pack = argv[++a];
+    } else if (arg == "-start" && more) {
+      if (sscanf(argv[++a], "%f,%f,%f", &view_pos[0], &view_pos[1], &view_pos[2]) != 3) {
+        usage(); return -1;
+      }
+      has_start = true;
+    } else if (arg == "-scale" && more) {
+      scale = (float)atof(argv[++a]);
+      if (scale <= 0.0f) { usage(); return -1; }
+    } else if (arg == "-threads" && more) {
+      num_threads = atoi(argv[++a]);
+    } else if (arg == "-no-reorder") {
+      reorder_leaves = false;
+    } else if (arg == "-no-deltas") {
+      pack_vertex_deltas = false;
+    } else if (arg == "-no-vertex-ids") {
+      pack_vertex_ids = false;
+    } else if (arg == "-vis-rle") {
+      vis_rle = true;
+    } else if (arg == "-no-mips") {
+      pack_mips = false;
+    } else if (arg == "-face-vis") {
+      face_vis = true;
+      if (more && isdigit(argv[a + 1][0])) {
+        face_vis_grid = max(1, atoi(argv[++a]));
+      }
+    } else if (arg == "-cache" && more) {
+      cache_dir = argv[++a];
+    } else if (arg == "-no-cache") {
+      cache_dir = "";
+    } else if (arg[0] == '-') {
+      usage(); return -1;
+    } else {
+      map_job job;
+      job.bsp       = arg;
+      job.has_start = false;
+      job.start     = v3f(0.0f);
+      jobs.push_back(job);
+    }
+  }
+  if (jobs.empty()) {
+    // default map, as placed by the Makefile
+    map_job job;
+    job.bsp       = SRC_PATH "/../" MAP;
+    job.has_start = true;
+    job.start     = view_pos;
+    jobs.push_back(job);
+  } else if (has_start) {
+    jobs.front().has_start = true;
+    jobs.front().start     = view_pos;
+  }
   // ----------------------------------------------------------------
-  // close bsp file
-  fclose(f);
+  /// gather game textures of all maps, so that texture ids are known
+  /// before light maps are given theirs
+  for (auto& job : jobs) {
+    if (!bsp.open(job.bsp.c_str())) {
+      fprintf(stderr, "\n\n[error] cannot open the bsp file %s\n"
+                      "(the default map " MAP " goes in the q5k directory)\n\n\n", job.bsp.c_str());
+      return -1;
+    }
+    h = *bsp.at<dheader_t>(0);
+    stage_map = job.bsp.substr(job.bsp.find_last_of("/\\") + 1);
+    int num_new = gatherTextures(job.miptex_to_tex);
+    printf("%s: %d textures, %d new\n", job.bsp.c_str(), (int)job.miptex_to_tex.size(), num_new);
+    bsp.close();
+  }
+  printf("%d textures in pack\n", (int)textures.size());
+  // ----------------------------------------------------------------
+  // produce data pack
+  // ----------------------------------------------------------------
+  FILE *pack = fopen(out_pack.c_str(), "w+b"); // read back, see packManifest
+  sl_assert(pack != NULL);
+  reserveTextureTable(pack);
+  for (int j = 0; j < (int)jobs.size(); ++j) {
+    sl_assert(bsp.open(jobs[j].bsp.c_str()));
+    fprintf(stderr, "==== %s\n", jobs[j].bsp.c_str());
+    stage_map = jobs[j].bsp.substr(jobs[j].bsp.find_last_of("/\\") + 1);
+    repackMap(pack, jobs[j]);
+    bsp.close();
+  }
+  // ----------------------------------------------------------------
+  /// pack all textures, after the maps
+  stage_map = "pack";
+  stage_clock tm = stageStart();
+  packTextures(pack);
+  // ----------------------------------------------------------------
+  /// manifest, last
+  packManifest(pack, jobs);
+  fclose(pack);
+  stageEnd("textures+manifest", tm, false);
+  // ----------------------------------------------------------------
+  /// report stage timings
+  double total = 0.0;
+  printf("stage timings%s:\n", cache_dir.empty() ? " (no cache)" : "");
+  for (const auto& st : stage_times) {
+    printf("  %-32s %9.1f ms%s\n", st.name.c_str(), st.ms, st.cached ? "  (cached)" : "");
+    total += st.ms;
+  }
+  printf("  %-32s %9.1f ms\n", "total", total);
   return 0;
 }
 
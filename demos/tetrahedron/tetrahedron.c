@@ -50,10 +50,7 @@ int view_dist = 600;
 
 static inline void project(const p3d* pt, p2d *pr)
 {
-	int z     = pt->z; // view space
-	int inv_z = 65536 / z;
-	pr->x = ((pt->x * inv_z) >> 8) + SCREEN_WIDTH/2;
-	pr->y = ((pt->y * inv_z) >> 8) + SCREEN_HEIGHT/2;
+  raster_project(pt, pr); // reciprocal table, no divide
 }
 
 // -----------------------------------------------------
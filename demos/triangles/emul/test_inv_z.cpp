@@ -0,0 +1,78 @@
+// @sylefeb, MIT license
+// g++ test_inv_z.cpp -o test_inv_z
+
+// Compares the table based perspective projection (raster_inv_z,
+// raster_project) against the exact integer divide.
+
+#define EMUL
+
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+
+#define SCREEN_WIDTH  320
+#define SCREEN_HEIGHT 240
+
+#include "../../../software/api/raster.c"
+
+/* -------------------------------------------------------- */
+
+// estimate only, without the refinement step
+int inv_z_estimate(int z)
+{
+  int m = z, s = 0;
+  while (m >= DIV_TABLE_SIZE) { m >>= 1; ++s; }
+  return inv_dx[m] >> s;
+}
+
+/* -------------------------------------------------------- */
+
+int main(int argc,const char **argv)
+{
+  raster_pre();
+
+  // reciprocals, over the full range of view space z (shorts)
+  int n_inv = 0, n_inv_diff = 0, max_inv_err = 0;
+  int n_est = 0, n_est_diff = 0, max_est_err = 0;
+  for (int z = -32768; z <= 32767; ++z) {
+    if (z == 0) continue;
+    int exact = 65536 / z;
+    int err   = abs(raster_inv_z(z) - exact);
+    if (err != 0) { ++n_inv_diff; }
+    if (err > max_inv_err) { max_inv_err = err; }
+    ++n_inv;
+    if (z >= DIV_TABLE_SIZE) {
+      err = abs(inv_z_estimate(z) - exact);
+      if (err != 0) { ++n_est_diff; }
+      if (err > max_est_err) { max_est_err = err; }
+      ++n_est;
+    }
+  }
+  printf("inv_z    : %d / %d differ from divide, max error %d\n",
+    n_inv_diff, n_inv, max_inv_err);
+  printf("estimate : %d / %d differ from divide, max error %d (z >= %d, no refinement)\n",
+    n_est_diff, n_est, max_est_err, DIV_TABLE_SIZE);
+
+  // projected positions, in front of the near plane
+  int n_prj = 0, n_prj_diff = 0, max_prj_err = 0;
+  for (int z = 1; z <= 32767; z += 3) {
+    for (int x = -4096; x <= 4096; x += 7) {
+      p3d p = { (short)x, (short)(x >> 1), (short)z };
+      p2d pr;
+      raster_project(&p, &pr);
+      int inv_z = 65536 / z;
+      int ex    = ((x * inv_z) >> 8) + SCREEN_WIDTH / 2;
+      int ey    = (((x >> 1) * inv_z) >> 8) + SCREEN_HEIGHT / 2;
+      int err   = abs((short)ex - pr.x) + abs((short)ey - pr.y);
+      if (err != 0) { ++n_prj_diff; }
+      if (err > max_prj_err) { max_prj_err = err; }
+      ++n_prj;
+    }
+  }
+  printf("project  : %d / %d differ from divide, max error %d pixels\n",
+    n_prj_diff, n_prj, max_prj_err);
+
+  return (n_inv_diff == 0 && n_prj_diff == 0) ? 0 : 1;
+}
+
+/* -------------------------------------------------------- */
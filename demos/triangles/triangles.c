@@ -81,11 +81,7 @@ static inline void transform(short *x, short *y, short *z,short w)
 
 static inline void project(const p3d* pt, p2d *pr)
 {
-	int z     = pt->z;     // view space
-	int inv_z = 65536 / z; // NOTE: could precomp in this demo, each triangle
-                         //       is at a fixed depth
-	pr->x = ((pt->x * inv_z) >> 8) + SCREEN_WIDTH/2;
-	pr->y = ((pt->y * inv_z) >> 8) + SCREEN_HEIGHT/2;
+  raster_project(pt, pr); // reciprocal table, no divide
 }
 
 // -----------------------------------------------------
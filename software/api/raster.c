@@ -131,6 +131,42 @@ static inline void raster_pre()
   }
 }
 
+// ____________________________________________________________________________
+// Returns 65536/z without a division, using the inv_dx table (raster_pre has
+// to be called first). Gives the same result as the divide for all z != 0.
+//
+// For z beyond the table, z is shifted down to m in [DIV_TABLE_SIZE/2,
+// DIV_TABLE_SIZE) and inv_dx[m] is shifted by the same amount. This estimate
+// is never below the exact value and above by at most one, so a single
+// refinement step (the integer form of a Newton iteration on the residual
+// 65536 - r*z) makes it exact.
+static inline int raster_inv_z(int z)
+{
+  int neg = z < 0;
+  if (neg) { z = -z; }
+  int r;
+  if (z < 2) {
+    r = 65536;           // z == 0 has no inverse, same as q5k's convention
+  } else if (z < DIV_TABLE_SIZE) {
+    r = inv_dx[z];       // exact
+  } else {
+    int m = z, s = 0;
+    while (m >= DIV_TABLE_SIZE) { m >>= 1; ++s; }
+    r = inv_dx[m] >> s;  // estimate
+    if (r * z > 65536) { --r; } // refine
+  }
+  return neg ? -r : r;
+}
+
+// ____________________________________________________________________________
+// Perspective projection of a view space point, screen centered
+static inline void raster_project(const p3d* pt, p2d *pr)
+{
+  int inv_z = raster_inv_z((int)pt->z);
+  pr->x = (short)((((int)pt->x * inv_z) >> 8) + SCREEN_WIDTH  / 2);
+  pr->y = (short)((((int)pt->y * inv_z) >> 8) + SCREEN_HEIGHT / 2);
+}
+
 // ____________________________________________________________________________
 // Initializes a redge, given the two endpoints x0,y0 and x1,y1
 static inline void redge_init(redge *l, int x0, int y0, int x1, int y1)